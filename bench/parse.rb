@@ -0,0 +1,66 @@
+# frozen_string_literal: true
+
+# Parse and traversal throughput per grammar:
+#
+#   ruby -Ilib bench/parse.rb [--repeat N] [--json] FILE...
+#
+# Files are grouped by language (see Tree::EXTENSION_MAP); languages whose
+# extension isn't built are skipped. --json prints the rates keyed by language
+# instead of a table.
+
+require 'benchmark'
+require 'json'
+require 'tree_sitter'
+
+repeat = 5
+if (index = ARGV.index('--repeat'))
+  repeat = Integer(ARGV.delete_at(index + 1))
+  ARGV.delete_at(index)
+end
+json = !ARGV.delete('--json').nil?
+abort "usage: #{$PROGRAM_NAME} [--repeat N] [--json] FILE..." if ARGV.empty?
+
+def measure(repeat)
+  GC.start
+  best = Float::INFINITY
+  result = nil
+  repeat.times do
+    time = Benchmark.realtime { result = yield }
+    best = time if time < best
+  end
+  [best, result]
+end
+
+by_language = ARGV.group_by { |file| TreeSitter::Tree::EXTENSION_MAP[File.extname(file)] }
+results = {}
+by_language.each do |language, files|
+  begin
+    klass = TreeSitter::Tree.for_filename(files.first)
+  rescue LoadError, RuntimeError => e
+    warn "skipping #{files.size} file(s) for #{language.inspect}: #{e.message}"
+    next
+  end
+
+  sources = files.map { File.binread(_1) }
+  bytes = sources.sum(&:bytesize)
+
+  parse_time, trees = measure(repeat) { sources.map { klass.parse(_1) } }
+  walk_time, node_count = measure(repeat) { trees.sum { _1.root_node.each_descendant.count } }
+  find_time, = measure(repeat) { trees.each { _1.root_node.find_all(named_only: true) } }
+
+  results[language] = {
+    'bytes' => bytes,
+    'parse' => bytes / 1e6 / parse_time,
+    'each_descendant' => node_count / 1e6 / walk_time,
+    'find_all' => node_count / 1e6 / find_time
+  }
+end
+
+if json
+  puts JSON.generate(results)
+else
+  results.each do |language, r|
+    puts format('%-12s %8.2f MB  parse %8.2f MB/s  each_descendant %8.2f Mnodes/s  find_all %8.2f Mnodes/s',
+                language, r['bytes'] / 1e6, r['parse'], r['each_descendant'], r['find_all'])
+  end
+end
@@ -1,4 +1,5 @@
 require 'mkmf'
+require_relative '../core/build_profile'
 $INCFLAGS << ' -I$(srcdir)/../core/vendor/include'
 $defs.push("-DLANGUAGE_C=16")
 create_makefile('c')
\ No newline at end of file
@@ -1,4 +1,5 @@
 require 'mkmf'
+require_relative '../core/build_profile'
 $INCFLAGS << ' -I$(srcdir)/../core/vendor/include'
 $defs.push("-DLANGUAGE_C_SHARP=8")
 create_makefile('c_sharp')
\ No newline at end of file
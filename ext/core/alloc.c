@@ -0,0 +1,321 @@
+#include "alloc.h"
+#include "tree_sitter/api.h"
+#include "common.h"
+
+#include <stdalign.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACKED_ARENA_MIN_CHUNK_SIZE (64 * 1024)
+#define TRACKED_ARENA_MAX_CHUNK_SIZE (4 * 1024 * 1024)
+
+// Precedes every block so frees and reallocs know what to uncount;
+// padded to keep the returned pointer aligned like malloc's.
+typedef struct {
+  alignas(max_align_t) size_t size;
+  int language;
+  bool arena;
+} TrackedAllocHeader;
+
+typedef struct TrackedArenaChunk {
+  struct TrackedArenaChunk *next;
+  size_t size;
+  size_t used;
+  alignas(max_align_t) char data[];
+} TrackedArenaChunk;
+
+struct TrackedArena {
+  TrackedArenaChunk *chunks;
+  size_t size;
+  uint32_t refcount;
+  int language;
+};
+
+static size_t live_bytes;
+static size_t live_count;
+static size_t language_live_bytes[TRACKED_ALLOC_LANGUAGES];
+static size_t reported_bytes;
+
+static _Thread_local int current_language = TRACKED_ALLOC_UNTAGGED;
+static _Thread_local TrackedArena *current_arena = NULL;
+// bytes allocated minus bytes freed by this thread, wrapping
+static _Thread_local size_t thread_bytes;
+
+static inline void
+tracked_alloc_count(int language, size_t size, int sign)
+{
+  if(sign > 0) {
+    thread_bytes += size;
+    __atomic_add_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&language_live_bytes[language], size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&live_count, 1, __ATOMIC_RELAXED);
+  } else {
+    thread_bytes -= size;
+    __atomic_sub_fetch(&live_bytes, size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&language_live_bytes[language], size, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&live_count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void *
+tracked_alloc_fail(size_t size)
+{
+  fprintf(stderr, "tree-sitter failed to allocate %zu bytes", size);
+  abort();
+}
+
+static inline size_t
+tracked_arena_block_size(size_t size)
+{
+  size_t align = alignof(max_align_t);
+  return (sizeof(TrackedAllocHeader) + size + align - 1) & ~(align - 1);
+}
+
+// Chunks are counted as single allocations of the arena's language.
+static TrackedArenaChunk *
+tracked_arena_add_chunk(TrackedArena *arena, size_t min_size)
+{
+  size_t size = CLAMP(arena->size, TRACKED_ARENA_MIN_CHUNK_SIZE, TRACKED_ARENA_MAX_CHUNK_SIZE);
+  size = MAX(size, min_size);
+
+  TrackedArenaChunk *chunk = malloc(sizeof(TrackedArenaChunk) + size);
+  if(chunk == NULL) {
+    tracked_alloc_fail(size);
+  }
+  chunk->next = arena->chunks;
+  chunk->size = size;
+  chunk->used = 0;
+  arena->chunks = chunk;
+  arena->size += sizeof(TrackedArenaChunk) + size;
+  tracked_alloc_count(arena->language, sizeof(TrackedArenaChunk) + size, 1);
+  return chunk;
+}
+
+static TrackedAllocHeader *
+tracked_arena_alloc(TrackedArena *arena, size_t size)
+{
+  size_t block_size = tracked_arena_block_size(size);
+  TrackedArenaChunk *chunk = arena->chunks;
+  if(chunk == NULL || chunk->size - chunk->used < block_size) {
+    chunk = tracked_arena_add_chunk(arena, block_size);
+  }
+  TrackedAllocHeader *header = (TrackedAllocHeader *) (chunk->data + chunk->used);
+  chunk->used += block_size;
+  header->size = size;
+  header->language = arena->language;
+  header->arena = true;
+  return header;
+}
+
+// Grows or shrinks the most recent block of the arena without moving it.
+static bool
+tracked_arena_resize_last(TrackedArena *arena, TrackedAllocHeader *header, size_t size)
+{
+  TrackedArenaChunk *chunk = arena->chunks;
+  char *block = (char *) header;
+  size_t old_block_size = tracked_arena_block_size(header->size);
+  if(chunk == NULL || block + old_block_size != chunk->data + chunk->used) {
+    return false;
+  }
+
+  size_t offset = block - chunk->data;
+  size_t block_size = tracked_arena_block_size(size);
+  if(chunk->size - offset < block_size) {
+    return false;
+  }
+  chunk->used = offset + block_size;
+  header->size = size;
+  return true;
+}
+
+static void *
+tracked_alloc_init_block(TrackedAllocHeader *header, size_t size)
+{
+  header->size = size;
+  header->language = current_language;
+  header->arena = false;
+  tracked_alloc_count(header->language, size, 1);
+  return header + 1;
+}
+
+static void *
+tracked_malloc(size_t size)
+{
+  if(current_arena != NULL) {
+    return tracked_arena_alloc(current_arena, size) + 1;
+  }
+
+  TrackedAllocHeader *header = malloc(sizeof(TrackedAllocHeader) + size);
+  if(header == NULL) {
+    return tracked_alloc_fail(size);
+  }
+  return tracked_alloc_init_block(header, size);
+}
+
+static void *
+tracked_calloc(size_t count, size_t size)
+{
+  if(size != 0 && count > (SIZE_MAX - sizeof(TrackedAllocHeader)) / size) {
+    return tracked_alloc_fail(SIZE_MAX);
+  }
+
+  if(current_arena != NULL) {
+    TrackedAllocHeader *header = tracked_arena_alloc(current_arena, count * size);
+    memset(header + 1, 0, count * size);
+    return header + 1;
+  }
+
+  TrackedAllocHeader *header = calloc(1, sizeof(TrackedAllocHeader) + count * size);
+  if(header == NULL) {
+    return tracked_alloc_fail(count * size);
+  }
+  return tracked_alloc_init_block(header, count * size);
+}
+
+static void *
+tracked_realloc(void *ptr, size_t size)
+{
+  if(ptr == NULL) {
+    return tracked_malloc(size);
+  }
+
+  TrackedAllocHeader *header = (TrackedAllocHeader *) ptr - 1;
+  int language = header->language;
+  size_t old_size = header->size;
+
+  // arena blocks are never freed individually: grow in place if the block is the
+  // arena's last, otherwise move to a new block (in the arena in use, if any)
+  if(header->arena) {
+    if(current_arena != NULL && tracked_arena_resize_last(current_arena, header, size)) {
+      return ptr;
+    }
+    void *new_ptr = tracked_malloc(size);
+    memcpy(new_ptr, ptr, MIN(old_size, size));
+    return new_ptr;
+  }
+
+  header = realloc(header, sizeof(TrackedAllocHeader) + size);
+  if(header == NULL) {
+    return tracked_alloc_fail(size);
+  }
+  // the block keeps the tag it was allocated with
+  tracked_alloc_count(language, old_size, -1);
+  header->size = size;
+  tracked_alloc_count(language, size, 1);
+  return header + 1;
+}
+
+static void
+tracked_free(void *ptr)
+{
+  if(ptr == NULL) {
+    return;
+  }
+  TrackedAllocHeader *header = (TrackedAllocHeader *) ptr - 1;
+  if(header->arena) {
+    return;
+  }
+  tracked_alloc_count(header->language, header->size, -1);
+  free(header);
+}
+
+void
+tracked_alloc_init(void)
+{
+  ts_set_allocator(tracked_malloc, tracked_calloc, tracked_realloc, tracked_free);
+}
+
+int
+tracked_alloc_tag(int language)
+{
+  int previous = current_language;
+  current_language = (language >= 0 && language < TRACKED_ALLOC_LANGUAGES) ? language : TRACKED_ALLOC_UNTAGGED;
+  return previous;
+}
+
+size_t
+tracked_alloc_live_bytes(void)
+{
+  return __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+}
+
+size_t
+tracked_alloc_thread_bytes(void)
+{
+  return thread_bytes;
+}
+
+size_t
+tracked_alloc_live_count(void)
+{
+  return __atomic_load_n(&live_count, __ATOMIC_RELAXED);
+}
+
+size_t
+tracked_alloc_language_live_bytes(int language)
+{
+  return __atomic_load_n(&language_live_bytes[language], __ATOMIC_RELAXED);
+}
+
+void
+tracked_alloc_sync_gc(void)
+{
+  size_t bytes = tracked_alloc_live_bytes();
+  ssize_t diff = (ssize_t) (bytes - reported_bytes);
+  reported_bytes = bytes;
+  if(diff != 0) {
+    rb_gc_adjust_memory_usage(diff);
+  }
+}
+
+TrackedArena *
+tracked_arena_new(int language)
+{
+  TrackedArena *arena = malloc(sizeof(TrackedArena));
+  if(arena == NULL) {
+    tracked_alloc_fail(sizeof(TrackedArena));
+  }
+  arena->chunks = NULL;
+  arena->size = 0;
+  arena->refcount = 1;
+  arena->language = (language >= 0 && language < TRACKED_ALLOC_LANGUAGES) ? language : TRACKED_ALLOC_UNTAGGED;
+  return arena;
+}
+
+void
+tracked_arena_retain(TrackedArena *arena)
+{
+  arena->refcount++;
+}
+
+void
+tracked_arena_release(TrackedArena *arena)
+{
+  if(--arena->refcount > 0) {
+    return;
+  }
+
+  TrackedArenaChunk *chunk = arena->chunks;
+  while(chunk != NULL) {
+    TrackedArenaChunk *next = chunk->next;
+    tracked_alloc_count(arena->language, sizeof(TrackedArenaChunk) + chunk->size, -1);
+    free(chunk);
+    chunk = next;
+  }
+  free(arena);
+}
+
+size_t
+tracked_arena_size(const TrackedArena *arena)
+{
+  return arena->size;
+}
+
+TrackedArena *
+tracked_alloc_use_arena(TrackedArena *arena)
+{
+  TrackedArena *previous = current_arena;
+  current_arena = arena;
+  return previous;
+}
@@ -1,9 +1,43 @@
 #pragma once
 
 #include "ruby.h"
+#include "language_ids.h"
 
-// this causes crashes, why?
-// #define ts_malloc ruby_xmalloc
-// #define ts_calloc ruby_xcalloc
-// #define ts_realloc ruby_xrealloc
-// #define ts_free    ruby_xfree
\ No newline at end of file
+// The runtime allocates through ts_set_allocator hooks that wrap malloc and count
+// live bytes per language (see alloc.c). They can't use ruby_xmalloc: that may run
+// the GC and needs the GVL, which Query#run_parallel's workers don't hold.
+
+#define TRACKED_ALLOC_LANGUAGES 32
+// allocations made outside a tracked_alloc_tag scope
+#define TRACKED_ALLOC_UNTAGGED (TRACKED_ALLOC_LANGUAGES - 1)
+
+void tracked_alloc_init(void);
+
+// Tags allocations made by the current thread with language until the previous
+// tag (the return value) is restored.
+int tracked_alloc_tag(int language);
+
+size_t tracked_alloc_live_bytes(void);
+size_t tracked_alloc_live_count(void);
+size_t tracked_alloc_language_live_bytes(int language);
+
+// Net bytes allocated by the calling thread, wrapping around. The difference
+// between two calls is what the thread retained in between, which other
+// threads' allocations don't disturb.
+size_t tracked_alloc_thread_bytes(void);
+
+// Reports live bytes allocated or freed since the last call to the GC. Needs the GVL.
+void tracked_alloc_sync_gc(void);
+
+// An arena serves every allocation made on a thread while it is in use
+// (tracked_alloc_use_arena) from large chunks. Frees of its blocks are no-ops;
+// all chunks are released at once when the last reference is released.
+typedef struct TrackedArena TrackedArena;
+
+TrackedArena *tracked_arena_new(int language);
+void tracked_arena_retain(TrackedArena *arena);
+void tracked_arena_release(TrackedArena *arena);
+size_t tracked_arena_size(const TrackedArena *arena);
+
+// Returns the arena in use before, NULL for none.
+TrackedArena *tracked_alloc_use_arena(TrackedArena *arena);
@@ -0,0 +1,57 @@
+# Compiler flags shared by the core and grammar extensions. The profile is
+# selected with TREE_SITTER_BUILD (see also the compile:* rake tasks):
+#
+#   release      - optimized, with link time optimization when the compiler
+#                  supports it (the default)
+#   debug        - unoptimized, full debug info
+#   asan         - debug plus AddressSanitizer; run ruby with libasan in
+#                  LD_PRELOAD
+#   pgo-generate - release, instrumented to write a profile to
+#                  TREE_SITTER_PGO_DIR when ruby exits
+#   pgo-use      - release, optimized with the profile in TREE_SITTER_PGO_DIR
+#
+# TREE_SITTER_MARCH (e.g. "native") adds -march tuning to optimized builds.
+profile = ENV.fetch('TREE_SITTER_BUILD', 'release')
+pgo_dir = File.expand_path(ENV.fetch('TREE_SITTER_PGO_DIR', File.join('..', '..', 'tmp', 'pgo')), __dir__)
+
+case profile
+when 'release', 'pgo-generate', 'pgo-use'
+  CONFIG['optflags'] = '-O3 -fno-fast-math'
+  CONFIG['debugflags'] = '-g'
+  # lib.c already builds the runtime as a single unit; LTO lets the compiler
+  # inline across it and the binding. =auto runs the link-time jobs in
+  # parallel (gcc), plain -flto is for compilers without it.
+  lto = %w[-flto=auto -flto].find { try_cflags(_1) && try_ldflags(_1) }
+  if lto
+    $CFLAGS << " #{lto}"
+    $LDFLAGS << " #{lto}"
+  end
+  if (march = ENV['TREE_SITTER_MARCH'])
+    append_cflags("-march=#{march}")
+  end
+
+  case profile
+  when 'pgo-generate'
+    $CFLAGS << " -fprofile-generate=#{pgo_dir}"
+    $LDFLAGS << " -fprofile-generate=#{pgo_dir}"
+  when 'pgo-use'
+    abort "no profile in #{pgo_dir}; build with TREE_SITTER_BUILD=pgo-generate first" unless File.directory?(pgo_dir)
+    $CFLAGS << " -fprofile-use=#{pgo_dir}"
+    $LDFLAGS << " -fprofile-use=#{pgo_dir}"
+    # code the training run never reached is fine, and so is a profile that
+    # predates a small edit (the warnings go first: mkmf's own test programs
+    # have no profile either)
+    append_cflags(%w[-Wno-missing-profile -Wno-coverage-mismatch -fprofile-partial-training])
+  end
+when 'debug', 'asan'
+  CONFIG['optflags'] = '-O0'
+  CONFIG['debugflags'] = '-ggdb3'
+  if profile == 'asan'
+    $CFLAGS << ' -fsanitize=address -fno-omit-frame-pointer'
+    $LDFLAGS << ' -fsanitize=address'
+    message "note: load libasan before ruby, e.g. LD_PRELOAD=$(gcc -print-file-name=libasan.so)\n"
+  end
+else
+  abort "unknown TREE_SITTER_BUILD profile #{profile.inspect} " \
+        '(expected release, debug, asan, pgo-generate or pgo-use)'
+end
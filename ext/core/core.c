@@ -7,7 +7,10 @@ __attribute__((visibility("default"))) void Init_core()
   VALUE rb_mTreeSitter = rb_define_module("TreeSitter");
   rb_eTreeSitterError = rb_define_class_under(rb_mTreeSitter, "Error", rb_eStandardError);
  
+  // before anything is allocated by the runtime
+  tracked_alloc_init();
   init_tree();
   init_node();
   init_misc();
+  init_dump();
 }
@@ -11,5 +11,7 @@
 #include "tree.h"
 #include "node.h"
 #include "misc.h"
+#include "dump.h"
+#include "alloc.h"
 
 void Init_treesitter();
\ No newline at end of file
@@ -0,0 +1,779 @@
+#include "dump.h"
+#include "node.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static VALUE rb_cTreeSnapshot;
+static VALUE rb_cTreeSnapshotNode;
+
+extern const rb_data_type_t language_type;
+
+static void
+tree_snapshot_free(void *obj)
+{
+  TreeSnapshot *snapshot = (TreeSnapshot *)obj;
+  if(snapshot->data != NULL) {
+    memory_stats.snapshots--;
+    memory_stats.snapshot_bytes -= snapshot->len;
+    munmap(snapshot->data, snapshot->len);
+  }
+  xfree(obj);
+}
+
+// the mapping is file-backed and can be paged out, so it is reported here
+// but not to the GC
+static size_t
+tree_snapshot_memsize(const void *obj)
+{
+  const TreeSnapshot *snapshot = (const TreeSnapshot *)obj;
+  return sizeof(TreeSnapshot) + snapshot->len;
+}
+
+static void
+tree_snapshot_mark(void *obj)
+{
+  TreeSnapshot *snapshot = (TreeSnapshot *)obj;
+  rb_gc_mark(snapshot->rb_language);
+}
+
+static const rb_data_type_t tree_snapshot_type = {
+    .wrap_struct_name = "TreeSnapshot",
+    .function = {
+        .dmark = tree_snapshot_mark,
+        .dfree = tree_snapshot_free,
+        .dsize = tree_snapshot_memsize,
+    },
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static void
+tree_snapshot_node_free(void *obj)
+{
+  xfree(obj);
+}
+
+static size_t
+tree_snapshot_node_memsize(const void *obj)
+{
+  return sizeof(TreeSnapshotNode);
+}
+
+static void
+tree_snapshot_node_mark(void *obj)
+{
+  TreeSnapshotNode *node = (TreeSnapshotNode *)obj;
+  rb_gc_mark(node->rb_snapshot);
+}
+
+static const rb_data_type_t tree_snapshot_node_type = {
+    .wrap_struct_name = "TreeSnapshotNode",
+    .function = {
+        .dmark = tree_snapshot_node_mark,
+        .dfree = tree_snapshot_node_free,
+        .dsize = tree_snapshot_node_memsize,
+    },
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/*
+ * Public: Encodes the tree (all nodes, named or not) and its attached source,
+ * if any, in the format read by Tree.load.
+ *
+ * Returns a binary {String}.
+ */
+static VALUE
+rb_tree_dump(VALUE self)
+{
+  Tree *tree = rb_tree_unwrap(self);
+  Language *language = tree->language;
+  TSNode root = ts_tree_root_node(tree->ts_tree);
+
+  uint32_t node_count = ts_node_descendant_count(root);
+  uint32_t source_len = NIL_P(tree->rb_input) ? 0 : (uint32_t) RSTRING_LEN(tree->rb_input);
+  size_t len = sizeof(TreeDumpHeader) + sizeof(TreeDumpNode) * node_count + source_len;
+
+  VALUE rb_dump = rb_str_buf_new(len);
+  rb_str_set_len(rb_dump, len);
+  char *data = RSTRING_PTR(rb_dump);
+  MEMZERO(data, char, len);
+
+  TreeDumpHeader *header = (TreeDumpHeader *) data;
+  MEMCPY(header->magic, TREE_DUMP_MAGIC, char, sizeof(header->magic));
+  header->byte_order = TREE_DUMP_BYTE_ORDER;
+  header->version = TREE_DUMP_VERSION;
+  header->flags = NIL_P(tree->rb_input) ? 0 : TREE_DUMP_FLAG_HAS_SOURCE;
+  header->language_id = language->id;
+  header->symbol_count = language->symbol_count;
+  header->field_count = language->field_count;
+  header->node_count = node_count;
+  header->source_len = source_len;
+
+  TreeDumpNode *nodes = (TreeDumpNode *) (data + sizeof(TreeDumpHeader));
+  uint32_t *parents = RB_ALLOC_N(uint32_t, tree_max_path_len(tree) + 1);
+  uint32_t depth = 0;
+  uint32_t i = 0;
+  parents[0] = TREE_DUMP_NO_PARENT;
+
+  TSTreeCursor cursor = ts_tree_cursor_new(root);
+  while(i < node_count) {
+    TSNode ts_node = ts_tree_cursor_current_node(&cursor);
+    TSPoint start = ts_node_start_point(ts_node);
+    TSPoint end = ts_node_end_point(ts_node);
+    uint32_t start_byte = ts_node_start_byte(ts_node);
+
+    TreeDumpNode *node = &nodes[i];
+    node->symbol = ts_node_symbol(ts_node);
+    node->field = ts_tree_cursor_current_field_id(&cursor);
+    node->flags = (ts_node_is_named(ts_node) ? TREE_DUMP_NODE_NAMED : 0) |
+                  (ts_node_is_missing(ts_node) ? TREE_DUMP_NODE_MISSING : 0) |
+                  (ts_node_is_extra(ts_node) ? TREE_DUMP_NODE_EXTRA : 0);
+    node->parent = parents[depth];
+    node->descendant_count = ts_node_descendant_count(ts_node);
+    node->child_count = ts_node_child_count(ts_node);
+    node->start_byte = start_byte;
+    node->byte_len = ts_node_end_byte(ts_node) - start_byte;
+    node->start_row = start.row;
+    node->start_column = start.column;
+    node->row_len = end.row - start.row;
+    node->end_column = end.column;
+
+    if(ts_tree_cursor_goto_first_child(&cursor)) {
+      parents[++depth] = i;
+    } else {
+      while(!ts_tree_cursor_goto_next_sibling(&cursor)) {
+        if(!ts_tree_cursor_goto_parent(&cursor)) {
+          goto done;
+        }
+        depth--;
+      }
+    }
+    i++;
+  }
+done:
+  ts_tree_cursor_delete(&cursor);
+  xfree(parents);
+
+  if(source_len > 0) {
+    MEMCPY(data + sizeof(TreeDumpHeader) + sizeof(TreeDumpNode) * node_count, RSTRING_PTR(tree->rb_input), char, source_len);
+  }
+
+  return rb_dump;
+}
+
+static void
+tree_snapshot_check(TreeSnapshot *snapshot, VALUE rb_path)
+{
+  const TreeDumpHeader *header = snapshot->header;
+  Language *language = snapshot->language;
+
+  if(snapshot->len < sizeof(TreeDumpHeader) || memcmp(header->magic, TREE_DUMP_MAGIC, sizeof(header->magic)) != 0) {
+    rb_raise(rb_eTreeSitterError, "%"PRIsVALUE" is not a tree dump", rb_path);
+  }
+  if(header->byte_order != TREE_DUMP_BYTE_ORDER || header->version != TREE_DUMP_VERSION) {
+    rb_raise(rb_eTreeSitterError, "%"PRIsVALUE" was dumped by an incompatible version or platform", rb_path);
+  }
+  if(header->language_id != (uint32_t) language->id ||
+     header->symbol_count != language->symbol_count ||
+     header->field_count != language->field_count) {
+    rb_raise(rb_eTreeSitterError, "%"PRIsVALUE" was dumped for a different language or grammar version", rb_path);
+  }
+  if(header->node_count == 0 ||
+     snapshot->len != sizeof(TreeDumpHeader) + sizeof(TreeDumpNode) * (size_t) header->node_count + header->source_len) {
+    rb_raise(rb_eTreeSitterError, "%"PRIsVALUE" is truncated", rb_path);
+  }
+
+  // every accessor trusts the records, so check them all once here
+  const TreeDumpNode *nodes = (const TreeDumpNode *) ((const char *) snapshot->data + sizeof(TreeDumpHeader));
+  uint32_t node_count = header->node_count;
+  bool has_source = (header->flags & TREE_DUMP_FLAG_HAS_SOURCE) != 0;
+  if(!has_source && header->source_len != 0) {
+    rb_raise(rb_eTreeSitterError, "%"PRIsVALUE" is corrupt", rb_path);
+  }
+
+  for(uint32_t i = 0; i < node_count; i++) {
+    const TreeDumpNode *node = &nodes[i];
+    bool valid = (node->symbol < header->symbol_count || node->symbol == (uint16_t) -1) &&
+                 node->field < header->field_count &&
+                 node->descendant_count >= 1 &&
+                 (uint64_t) i + node->descendant_count <= node_count &&
+                 (!has_source || (uint64_t) node->start_byte + node->byte_len <= header->source_len);
+
+    if(valid && i == 0) {
+      valid = node->parent == TREE_DUMP_NO_PARENT;
+    } else if(valid) {
+      // nested in its parent's span (the parent was checked already)
+      const TreeDumpNode *parent = &nodes[node->parent < i ? node->parent : 0];
+      valid = node->parent < i &&
+              (uint64_t) i + node->descendant_count <= (uint64_t) node->parent + parent->descendant_count;
+    }
+
+    if(!valid) {
+      rb_raise(rb_eTreeSitterError, "%"PRIsVALUE" is corrupt (node %u)", rb_path, i);
+    }
+  }
+
+  // with the spans valid, walking the children of each node stays in bounds
+  for(uint32_t i = 0; i < node_count; i++) {
+    uint32_t child_count = 0;
+    uint32_t end = i + nodes[i].descendant_count;
+    for(uint32_t child = i + 1; child < end; child += nodes[child].descendant_count) {
+      if(nodes[child].parent != i) {
+        rb_raise(rb_eTreeSitterError, "%"PRIsVALUE" is corrupt (node %u)", rb_path, child);
+      }
+      child_count++;
+    }
+    if(child_count != nodes[i].child_count) {
+      rb_raise(rb_eTreeSitterError, "%"PRIsVALUE" is corrupt (node %u)", rb_path, i);
+    }
+  }
+}
+
+/*
+ * Public: Maps a file written by Tree#dump as a read-only tree. Must be called
+ * on the language class the tree was parsed with, e.g. TreeSitter::Python.load(path).
+ *
+ * Returns a {Tree::Snapshot}.
+ */
+static VALUE
+rb_tree_load(VALUE self, VALUE rb_path)
+{
+  VALUE rb_language = rb_language_of(self);
+  if(NIL_P(rb_language)) {
+    rb_raise(rb_eArgError, "load must be called on a language class");
+  }
+
+  rb_path = rb_get_path(rb_path);
+
+  TreeSnapshot *snapshot;
+  VALUE rb_snapshot = TypedData_Make_Struct(rb_cTreeSnapshot, TreeSnapshot, &tree_snapshot_type, snapshot);
+  snapshot->rb_language = rb_language;
+  TypedData_Get_Struct(rb_language, Language, &language_type, snapshot->language);
+
+  int fd = open(RSTRING_PTR(rb_path), O_RDONLY);
+  if(fd < 0) {
+    rb_sys_fail_str(rb_path);
+  }
+
+  struct stat st;
+  if(fstat(fd, &st) < 0) {
+    int e = errno;
+    close(fd);
+    errno = e;
+    rb_sys_fail_str(rb_path);
+  }
+
+  if(st.st_size > 0) {
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(data == MAP_FAILED) {
+      int e = errno;
+      close(fd);
+      errno = e;
+      rb_sys_fail_str(rb_path);
+    }
+    snapshot->data = data;
+    snapshot->len = st.st_size;
+    memory_stats.snapshots++;
+    memory_stats.snapshot_bytes += snapshot->len;
+  }
+  close(fd);
+
+  snapshot->header = (const TreeDumpHeader *) snapshot->data;
+  tree_snapshot_check(snapshot, rb_path);
+
+  snapshot->nodes = (const TreeDumpNode *) ((const char *) snapshot->data + sizeof(TreeDumpHeader));
+  snapshot->source = (const char *) (snapshot->nodes + snapshot->header->node_count);
+
+  return rb_snapshot;
+}
+
+static VALUE
+rb_new_tree_snapshot_node(VALUE rb_snapshot, uint32_t index)
+{
+  TreeSnapshotNode *node;
+  VALUE rb_node = TypedData_Make_Struct(rb_cTreeSnapshotNode, TreeSnapshotNode, &tree_snapshot_node_type, node);
+  node->rb_snapshot = rb_snapshot;
+  node->index = index;
+  return rb_node;
+}
+
+static TreeSnapshot *
+tree_snapshot_unwrap(VALUE rb_snapshot)
+{
+  TreeSnapshot *snapshot;
+  TypedData_Get_Struct(rb_snapshot, TreeSnapshot, &tree_snapshot_type, snapshot);
+  return snapshot;
+}
+
+static const TreeDumpNode *
+tree_snapshot_node_unwrap(VALUE self, TreeSnapshotNode **out_node, TreeSnapshot **out_snapshot)
+{
+  TreeSnapshotNode *node;
+  TypedData_Get_Struct(self, TreeSnapshotNode, &tree_snapshot_node_type, node);
+  TreeSnapshot *snapshot = tree_snapshot_unwrap(node->rb_snapshot);
+  *out_node = node;
+  if(out_snapshot != NULL) {
+    *out_snapshot = snapshot;
+  }
+  return &snapshot->nodes[node->index];
+}
+
+#define TREE_SNAPSHOT_NODE(self) \
+  TreeSnapshotNode *node; \
+  TreeSnapshot *snapshot; \
+  const TreeDumpNode *dump_node = tree_snapshot_node_unwrap(self, &node, &snapshot); \
+  (void) dump_node; (void) snapshot
+
+#define TREE_SNAPSHOT_EACH_CHILD(snapshot, index, child) \
+  for(uint32_t child = (index) + 1, child##_end = (index) + (snapshot)->nodes[index].descendant_count; \
+      child < child##_end; \
+      child += (snapshot)->nodes[child].descendant_count)
+
+static VALUE
+tree_snapshot_text(TreeSnapshot *snapshot, const TreeDumpNode *dump_node)
+{
+  if(!(snapshot->header->flags & TREE_DUMP_FLAG_HAS_SOURCE)) {
+    rb_raise(rb_eTreeSitterError, "no input attached");
+  }
+  return rb_str_new(snapshot->source + dump_node->start_byte, dump_node->byte_len);
+}
+
+/*
+ * Public: Returns the root node.
+ *
+ * Returns a {Tree::Snapshot::Node}.
+ */
+static VALUE
+rb_tree_snapshot_root_node(VALUE self)
+{
+  tree_snapshot_unwrap(self);
+  return rb_new_tree_snapshot_node(self, 0);
+}
+
+static VALUE
+rb_tree_snapshot_language(VALUE self)
+{
+  return tree_snapshot_unwrap(self)->rb_language;
+}
+
+static VALUE
+rb_tree_snapshot_node_count(VALUE self)
+{
+  return UINT2NUM(tree_snapshot_unwrap(self)->header->node_count);
+}
+
+static VALUE
+rb_tree_snapshot_attached_p(VALUE self)
+{
+  return (tree_snapshot_unwrap(self)->header->flags & TREE_DUMP_FLAG_HAS_SOURCE) ? Qtrue : Qfalse;
+}
+
+/*
+ * Public: Returns the source text the tree was parsed from, or nil if
+ * the tree was detached when dumped.
+ *
+ * Returns a {String}.
+ */
+static VALUE
+rb_tree_snapshot_source(VALUE self)
+{
+  TreeSnapshot *snapshot = tree_snapshot_unwrap(self);
+  if(!(snapshot->header->flags & TREE_DUMP_FLAG_HAS_SOURCE)) {
+    return Qnil;
+  }
+  return rb_str_new(snapshot->source, snapshot->header->source_len);
+}
+
+static VALUE
+rb_tree_snapshot_node_tree(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return node->rb_snapshot;
+}
+
+static VALUE
+rb_tree_snapshot_node_type(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  TSSymbol symbol = dump_node->symbol;
+  return RB_ID2SYM(language_symbol2id(snapshot->language, symbol));
+}
+
+static VALUE
+rb_tree_snapshot_node_field(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  if(dump_node->field == 0) {
+    return Qnil;
+  }
+  return RB_ID2SYM(language_field2id(snapshot->language, dump_node->field));
+}
+
+static VALUE
+rb_tree_snapshot_node_is_named(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return (dump_node->flags & TREE_DUMP_NODE_NAMED) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_tree_snapshot_node_is_missing(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return (dump_node->flags & TREE_DUMP_NODE_MISSING) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_tree_snapshot_node_is_extra(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return (dump_node->flags & TREE_DUMP_NODE_EXTRA) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_tree_snapshot_node_child_count(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return UINT2NUM(dump_node->child_count);
+}
+
+static uint32_t
+tree_snapshot_named_child_count(TreeSnapshot *snapshot, uint32_t index)
+{
+  uint32_t count = 0;
+  TREE_SNAPSHOT_EACH_CHILD(snapshot, index, child) {
+    if(snapshot->nodes[child].flags & TREE_DUMP_NODE_NAMED) {
+      count++;
+    }
+  }
+  return count;
+}
+
+static VALUE
+rb_tree_snapshot_node_named_child_count(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return UINT2NUM(tree_snapshot_named_child_count(snapshot, node->index));
+}
+
+static VALUE
+tree_snapshot_children(VALUE self, bool named_only, bool yield)
+{
+  TREE_SNAPSHOT_NODE(self);
+  VALUE rb_ary = yield ? Qnil : rb_ary_new_capa(dump_node->child_count);
+  VALUE rb_snapshot = node->rb_snapshot;
+  uint32_t index = node->index;
+
+  TREE_SNAPSHOT_EACH_CHILD(snapshot, index, child) {
+    if(named_only && !(snapshot->nodes[child].flags & TREE_DUMP_NODE_NAMED)) {
+      continue;
+    }
+    VALUE rb_child = rb_new_tree_snapshot_node(rb_snapshot, child);
+    if(yield) {
+      rb_yield(rb_child);
+    } else {
+      rb_ary_push(rb_ary, rb_child);
+    }
+  }
+  return yield ? self : rb_ary;
+}
+
+static VALUE
+rb_tree_snapshot_node_children(VALUE self)
+{
+  return tree_snapshot_children(self, false, false);
+}
+
+static VALUE
+rb_tree_snapshot_node_named_children(VALUE self)
+{
+  return tree_snapshot_children(self, true, false);
+}
+
+static VALUE
+rb_tree_snapshot_node_each_child(VALUE self)
+{
+  RETURN_ENUMERATOR(self, 0, 0);
+  return tree_snapshot_children(self, false, true);
+}
+
+static VALUE
+rb_tree_snapshot_node_each_named_child(VALUE self)
+{
+  RETURN_ENUMERATOR(self, 0, 0);
+  return tree_snapshot_children(self, true, true);
+}
+
+static VALUE
+tree_snapshot_child_at(VALUE self, VALUE rb_index, bool named_only)
+{
+  TREE_SNAPSHOT_NODE(self);
+  int64_t i = NUM2LONG(rb_index);
+  int64_t child_count = named_only ? tree_snapshot_named_child_count(snapshot, node->index) : dump_node->child_count;
+
+  if(i < 0) {
+    i += child_count;
+  }
+  if(i < 0 || i >= child_count) {
+    return Qnil;
+  }
+
+  TREE_SNAPSHOT_EACH_CHILD(snapshot, node->index, child) {
+    if(named_only && !(snapshot->nodes[child].flags & TREE_DUMP_NODE_NAMED)) {
+      continue;
+    }
+    if(i-- == 0) {
+      return rb_new_tree_snapshot_node(node->rb_snapshot, child);
+    }
+  }
+  return Qnil;
+}
+
+static VALUE
+rb_tree_snapshot_node_child_at(VALUE self, VALUE rb_index)
+{
+  return tree_snapshot_child_at(self, rb_index, false);
+}
+
+static VALUE
+rb_tree_snapshot_node_named_child_at(VALUE self, VALUE rb_index)
+{
+  return tree_snapshot_child_at(self, rb_index, true);
+}
+
+static VALUE
+rb_tree_snapshot_node_first_child(VALUE self)
+{
+  return tree_snapshot_child_at(self, INT2FIX(0), false);
+}
+
+static VALUE
+rb_tree_snapshot_node_last_child(VALUE self)
+{
+  return tree_snapshot_child_at(self, INT2FIX(-1), false);
+}
+
+static VALUE
+rb_tree_snapshot_node_first_named_child(VALUE self)
+{
+  return tree_snapshot_child_at(self, INT2FIX(0), true);
+}
+
+static VALUE
+rb_tree_snapshot_node_last_named_child(VALUE self)
+{
+  return tree_snapshot_child_at(self, INT2FIX(-1), true);
+}
+
+static VALUE
+rb_tree_snapshot_node_child_by_field(VALUE self, VALUE rb_field)
+{
+  Check_Type(rb_field, T_SYMBOL);
+  TREE_SNAPSHOT_NODE(self);
+
+  TSFieldId field_id;
+  if(!language_id2field(snapshot->language, SYM2ID(rb_field), &field_id)) {
+    return Qnil;
+  }
+
+  TREE_SNAPSHOT_EACH_CHILD(snapshot, node->index, child) {
+    if(snapshot->nodes[child].field == field_id) {
+      return rb_new_tree_snapshot_node(node->rb_snapshot, child);
+    }
+  }
+  return Qnil;
+}
+
+static VALUE
+rb_tree_snapshot_node_parent(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  if(dump_node->parent == TREE_DUMP_NO_PARENT) {
+    return Qnil;
+  }
+  return rb_new_tree_snapshot_node(node->rb_snapshot, dump_node->parent);
+}
+
+static VALUE
+rb_tree_snapshot_node_parents(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  VALUE rb_ary = rb_ary_new_capa(3);
+  for(uint32_t parent = dump_node->parent; parent != TREE_DUMP_NO_PARENT; parent = snapshot->nodes[parent].parent) {
+    rb_ary_push(rb_ary, rb_new_tree_snapshot_node(node->rb_snapshot, parent));
+  }
+  return rb_ary;
+}
+
+static VALUE
+rb_tree_snapshot_node_start_byte(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return UINT2NUM(dump_node->start_byte);
+}
+
+static VALUE
+rb_tree_snapshot_node_end_byte(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return UINT2NUM(dump_node->start_byte + dump_node->byte_len);
+}
+
+static VALUE
+rb_tree_snapshot_node_byte_range(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  uint32_t end_byte = dump_node->start_byte + dump_node->byte_len;
+  return rb_range_new(INT2FIX(dump_node->start_byte), INT2FIX(end_byte - 1), FALSE);
+}
+
+static VALUE
+rb_tree_snapshot_node_start_point(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return rb_new_point((TSPoint) { dump_node->start_row, dump_node->start_column });
+}
+
+static VALUE
+rb_tree_snapshot_node_end_point(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return rb_new_point((TSPoint) { dump_node->start_row + dump_node->row_len, dump_node->end_column });
+}
+
+static VALUE
+rb_tree_snapshot_node_start_row(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return UINT2NUM(dump_node->start_row);
+}
+
+static VALUE
+rb_tree_snapshot_node_start_column(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return UINT2NUM(dump_node->start_column);
+}
+
+static VALUE
+rb_tree_snapshot_node_end_row(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return UINT2NUM(dump_node->start_row + dump_node->row_len);
+}
+
+static VALUE
+rb_tree_snapshot_node_end_column(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return UINT2NUM(dump_node->end_column);
+}
+
+static VALUE
+rb_tree_snapshot_node_positions(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  VALUE rb_positions = rb_ary_new_from_args(6,
+    UINT2NUM(dump_node->start_byte),
+    UINT2NUM(dump_node->start_byte + dump_node->byte_len),
+    UINT2NUM(dump_node->start_row),
+    UINT2NUM(dump_node->start_column),
+    UINT2NUM(dump_node->start_row + dump_node->row_len),
+    UINT2NUM(dump_node->end_column));
+  return rb_ary_freeze(rb_positions);
+}
+
+static VALUE
+rb_tree_snapshot_node_text(VALUE self)
+{
+  TREE_SNAPSHOT_NODE(self);
+  return tree_snapshot_text(snapshot, dump_node);
+}
+
+static VALUE
+rb_tree_snapshot_node_eq(VALUE self, VALUE rb_other)
+{
+  if(!rb_typeddata_is_kind_of(rb_other, &tree_snapshot_node_type)) {
+    return Qfalse;
+  }
+
+  TreeSnapshotNode *node, *other;
+  TypedData_Get_Struct(self, TreeSnapshotNode, &tree_snapshot_node_type, node);
+  TypedData_Get_Struct(rb_other, TreeSnapshotNode, &tree_snapshot_node_type, other);
+
+  return (node->rb_snapshot == other->rb_snapshot && node->index == other->index) ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_tree_snapshot_node_hash(VALUE self)
+{
+  TreeSnapshotNode *node;
+  TypedData_Get_Struct(self, TreeSnapshotNode, &tree_snapshot_node_type, node);
+
+  st_index_t hash = rb_hash_start((st_index_t) node->rb_snapshot);
+  hash = rb_hash_uint32(hash, node->index);
+  return RB_ST2FIX(rb_hash_end(hash));
+}
+
+void
+init_dump()
+{
+  VALUE rb_mTreeSitter = rb_define_module("TreeSitter");
+  VALUE rb_cTree = rb_define_class_under(rb_mTreeSitter, "Tree", rb_cObject);
+
+  rb_define_private_method(rb_cTree, "__dump__", rb_tree_dump, 0);
+  rb_define_singleton_method(rb_cTree, "load", rb_tree_load, 1);
+
+  rb_cTreeSnapshot = rb_define_class_under(rb_cTree, "Snapshot", rb_cObject);
+  rb_undef_alloc_func(rb_cTreeSnapshot);
+  rb_define_method(rb_cTreeSnapshot, "root_node", rb_tree_snapshot_root_node, 0);
+  rb_define_method(rb_cTreeSnapshot, "language", rb_tree_snapshot_language, 0);
+  rb_define_method(rb_cTreeSnapshot, "node_count", rb_tree_snapshot_node_count, 0);
+  rb_define_method(rb_cTreeSnapshot, "source", rb_tree_snapshot_source, 0);
+  rb_define_method(rb_cTreeSnapshot, "attached?", rb_tree_snapshot_attached_p, 0);
+
+  rb_cTreeSnapshotNode = rb_define_class_under(rb_cTreeSnapshot, "Node", rb_cObject);
+  rb_undef_alloc_func(rb_cTreeSnapshotNode);
+  rb_define_method(rb_cTreeSnapshotNode, "tree", rb_tree_snapshot_node_tree, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "type", rb_tree_snapshot_node_type, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "field", rb_tree_snapshot_node_field, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "named?", rb_tree_snapshot_node_is_named, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "missing?", rb_tree_snapshot_node_is_missing, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "extra?", rb_tree_snapshot_node_is_extra, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "child_count", rb_tree_snapshot_node_child_count, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "named_child_count", rb_tree_snapshot_node_named_child_count, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "children", rb_tree_snapshot_node_children, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "named_children", rb_tree_snapshot_node_named_children, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "each_child", rb_tree_snapshot_node_each_child, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "each_named_child", rb_tree_snapshot_node_each_named_child, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "child_at", rb_tree_snapshot_node_child_at, 1);
+  rb_define_method(rb_cTreeSnapshotNode, "named_child_at", rb_tree_snapshot_node_named_child_at, 1);
+  rb_define_method(rb_cTreeSnapshotNode, "first_child", rb_tree_snapshot_node_first_child, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "last_child", rb_tree_snapshot_node_last_child, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "first_named_child", rb_tree_snapshot_node_first_named_child, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "last_named_child", rb_tree_snapshot_node_last_named_child, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "child_by_field", rb_tree_snapshot_node_child_by_field, 1);
+  rb_define_method(rb_cTreeSnapshotNode, "parent", rb_tree_snapshot_node_parent, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "parents", rb_tree_snapshot_node_parents, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "start_byte", rb_tree_snapshot_node_start_byte, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "end_byte", rb_tree_snapshot_node_end_byte, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "byte_range", rb_tree_snapshot_node_byte_range, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "start_point", rb_tree_snapshot_node_start_point, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "end_point", rb_tree_snapshot_node_end_point, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "start_row", rb_tree_snapshot_node_start_row, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "start_column", rb_tree_snapshot_node_start_column, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "end_row", rb_tree_snapshot_node_end_row, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "end_column", rb_tree_snapshot_node_end_column, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "positions", rb_tree_snapshot_node_positions, 0);
+  rb_define_alias(rb_cTreeSnapshotNode, "start_position", "start_point");
+  rb_define_alias(rb_cTreeSnapshotNode, "end_position", "end_point");
+  rb_define_method(rb_cTreeSnapshotNode, "text", rb_tree_snapshot_node_text, 0);
+  rb_define_method(rb_cTreeSnapshotNode, "==", rb_tree_snapshot_node_eq, 1);
+  rb_define_method(rb_cTreeSnapshotNode, "eql?", rb_tree_snapshot_node_eq, 1);
+  rb_define_method(rb_cTreeSnapshotNode, "hash", rb_tree_snapshot_node_hash, 0);
+}
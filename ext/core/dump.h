@@ -0,0 +1,70 @@
+#pragma once
+
+#include "ruby.h"
+#include "tree_sitter/api.h"
+#include "tree.h"
+
+#define TREE_DUMP_MAGIC "TSDM"
+#define TREE_DUMP_VERSION 1
+#define TREE_DUMP_BYTE_ORDER 0x01020304
+#define TREE_DUMP_NO_PARENT UINT32_MAX
+
+typedef enum {
+  TREE_DUMP_FLAG_HAS_SOURCE = 1 << 0,
+} TreeDumpFlags;
+
+typedef enum {
+  TREE_DUMP_NODE_NAMED = 1 << 0,
+  TREE_DUMP_NODE_MISSING = 1 << 1,
+  TREE_DUMP_NODE_EXTRA = 1 << 2,
+} TreeDumpNodeFlags;
+
+// Layout of a dumped tree: the header, node_count nodes in preorder, then
+// source_len bytes of source text. Records are fixed width so a mapped file
+// can be navigated in place: the first child of node i is i + 1, its next
+// sibling is i + descendant_count.
+typedef struct {
+  char magic[4];
+  uint32_t byte_order;
+  uint16_t version;
+  uint16_t flags;
+  uint32_t language_id;
+  uint32_t symbol_count;
+  uint32_t field_count;
+  uint32_t node_count;
+  uint32_t source_len;
+} TreeDumpHeader;
+
+typedef struct {
+  uint16_t symbol;
+  uint16_t field;
+  uint8_t flags;
+  uint8_t reserved[3];
+  uint32_t parent;
+  // this node and all of its descendants
+  uint32_t descendant_count;
+  uint32_t child_count;
+  uint32_t start_byte;
+  uint32_t byte_len;
+  uint32_t start_row;
+  uint32_t start_column;
+  uint32_t row_len;
+  uint32_t end_column;
+} TreeDumpNode;
+
+typedef struct {
+  void *data;
+  size_t len;
+  const TreeDumpHeader *header;
+  const TreeDumpNode *nodes;
+  const char *source;
+  Language *language;
+  VALUE rb_language;
+} TreeSnapshot;
+
+typedef struct {
+  VALUE rb_snapshot;
+  uint32_t index;
+} TreeSnapshotNode;
+
+void init_dump();
@@ -1,8 +1,6 @@
 require 'mkmf'
+require_relative 'build_profile'
 
 $INCFLAGS << ' -I$(srcdir)/vendor/include'
-#$LDFLAGS = '-fsanitize=address -lasan ' + $LDFLAGS
-#$CFLAGS += ' -fsanitize=address'
-CONFIG['debugflags'] << ' -ggdb3 -O0'
 
 create_makefile('core')
@@ -1,6 +1,5 @@
 #define _POSIX_C_SOURCE 200112L
 
-#include "alloc.h"
 #include "vendor/src/alloc.c"
 #include "vendor/src/get_changed_ranges.c"
 #include "vendor/src/language.c"
@@ -13,3 +12,66 @@
 #include "vendor/src/tree_cursor.c"
 #include "vendor/src/tree.c"
 #include "vendor/src/wasm.c"
+
+void ts_query_cursor__set_pattern_state_counts(TSQueryCursor *self, uint64_t *pattern_state_counts) {
+  self->pattern_state_counts = pattern_state_counts;
+}
+
+void ts_query_cursor__trim_capture_lists(TSQueryCursor *self) {
+  CaptureListPool *pool = &self->capture_list_pool;
+  while (pool->list.size > pool->max_capture_list_count) {
+    array_delete(&pool->list.contents[--pool->list.size]);
+  }
+}
+
+// The cursor returns captures of unfinished matches once the rest of their
+// pattern is guaranteed. Clearing the guarantees holds them back until the
+// match is finished, so predicates see all of its captures.
+void ts_query__hold_pattern_captures(TSQuery *self, uint32_t pattern_index) {
+  Slice steps = self->patterns.contents[pattern_index].steps;
+  for (uint32_t i = steps.offset; i < steps.offset + steps.length; i++) {
+    self->steps.contents[i].root_pattern_guaranteed = false;
+  }
+}
+
+#define ts_array_memsize(array) ((size_t) (array)->capacity * sizeof(*(array)->contents))
+
+size_t ts_tree_cursor__memsize(const TSTreeCursor *self) {
+  const TreeCursor *cursor = (const TreeCursor *) self;
+  return ts_array_memsize(&cursor->stack);
+}
+
+static size_t symbol_table_memsize(const SymbolTable *self) {
+  return ts_array_memsize(&self->characters) + ts_array_memsize(&self->slices);
+}
+
+size_t ts_query__memsize(const TSQuery *self) {
+  size_t size = sizeof(TSQuery) +
+    symbol_table_memsize(&self->captures) +
+    symbol_table_memsize(&self->predicate_values) +
+    ts_array_memsize(&self->capture_quantifiers) +
+    ts_array_memsize(&self->steps) +
+    ts_array_memsize(&self->pattern_map) +
+    ts_array_memsize(&self->predicate_steps) +
+    ts_array_memsize(&self->patterns) +
+    ts_array_memsize(&self->step_offsets) +
+    ts_array_memsize(&self->negated_fields) +
+    ts_array_memsize(&self->string_buffer) +
+    ts_array_memsize(&self->repeat_symbols_with_rootless_patterns);
+  for (uint32_t i = 0; i < self->capture_quantifiers.size; i++) {
+    size += ts_array_memsize(&self->capture_quantifiers.contents[i]);
+  }
+  return size;
+}
+
+size_t ts_query_cursor__memsize(const TSQueryCursor *self) {
+  size_t size = sizeof(TSQueryCursor) +
+    ts_tree_cursor__memsize(&self->cursor) +
+    ts_array_memsize(&self->states) +
+    ts_array_memsize(&self->finished_states) +
+    ts_array_memsize(&self->capture_list_pool.list);
+  for (uint32_t i = 0; i < self->capture_list_pool.list.size; i++) {
+    size += ts_array_memsize(&self->capture_list_pool.list.contents[i]);
+  }
+  return size;
+}
@@ -36,12 +36,29 @@ subtree_counter_mark(void* obj)
   rb_gc_mark(subtree_counter->rb_language);
 }
 
+static size_t
+subtree_counter_memsize(const void* obj)
+{
+  const SubtreeCounter* subtree_counter = (const SubtreeCounter*)obj;
+  size_t size = sizeof(SubtreeCounter) + st_memsize(subtree_counter->id_map) +
+                subtree_counter->entries_capa * sizeof(SubtreeCounterEntry *) +
+                MAX(subtree_counter->types_len, 0) * sizeof(uint16_t);
+  for(size_t i = 0; i < subtree_counter->entries_len; i++) {
+    const SubtreeCounterEntry *entry = subtree_counter->entries_ptrs[i];
+    size += sizeof(SubtreeCounterEntry) + entry->text_len;
+    if(entry->children != NULL) {
+      size += (entry->child_count - SUBTREE_COUNTER_ENTRY_MAX_CHILDREN) * sizeof(SubtreeCounterEntryChild);
+    }
+  }
+  return size;
+}
+
 static const rb_data_type_t subtree_counter_type = {
     .wrap_struct_name = "SubtreeCounter",
     .function = {
         .dmark = subtree_counter_mark,
         .dfree = subtree_counter_free,
-        .dsize = NULL,
+        .dsize = subtree_counter_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -64,12 +81,19 @@ subtree_counter_entry_rb_mark(void* obj)
   rb_gc_mark(subtree_counter_entry->rb_subtree_counter);
 }
 
+// entries belong to (and are accounted to) the counter
+static size_t
+subtree_counter_entry_rb_memsize(const void* obj)
+{
+  return sizeof(SubtreeCounterEntryRb);
+}
+
 static const rb_data_type_t subtree_counter_entry_type = {
     .wrap_struct_name = "SubtreeCounter::Entry",
     .function = {
         .dmark = subtree_counter_entry_rb_mark,
         .dfree = subtree_counter_entry_rb_free,
-        .dsize = NULL,
+        .dsize = subtree_counter_entry_rb_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -754,6 +778,243 @@ subtree_counter_entry_to_json(SubtreeCounterEntry *entry, Language *language, ui
   }
 }
 
+// Streams a node in the same shape as Node#to_h, without building intermediate
+// Ruby objects. Byte ranges become [first, last] pairs, like the inclusive Ranges of to_h. Output goes to rb_buf, which is flushed to rb_io (if given)
+// whenever it grows beyond NODE_SERIALIZE_FLUSH_SIZE.
+
+#define NODE_SERIALIZE_FLUSH_SIZE (64 * 1024)
+
+typedef struct {
+  TSTreeCursor cursor;
+  TSNode node;
+  Tree *tree;
+  VALUE rb_buf;
+  VALUE rb_io;
+  NodeSerializeFormat format;
+  bool byte_ranges;
+  bool unnamed;
+} NodeSerializer;
+
+static void
+node_serializer_flush(NodeSerializer *serializer, bool force) {
+  if(NIL_P(serializer->rb_io)) return;
+  long len = RSTRING_LEN(serializer->rb_buf);
+  if(len > 0 && (force || len >= NODE_SERIALIZE_FLUSH_SIZE)) {
+    VALUE rb_buf = serializer->rb_buf;
+    rb_io_write(serializer->rb_io, rb_buf);
+    // the io might hold on to the written string, so it is not reused
+    serializer->rb_buf = rb_str_buf_new(NODE_SERIALIZE_FLUSH_SIZE);
+    rb_enc_copy(serializer->rb_buf, rb_buf);
+  }
+}
+
+static void
+msgpack_write_header(VALUE rb_buf, uint8_t fix_tag, uint8_t fix_max, uint8_t tag16, uint8_t tag32, uint32_t len) {
+  if(len <= fix_max) {
+    char c = (char) (fix_tag | len);
+    rb_str_cat(rb_buf, &c, 1);
+  } else if(len <= UINT16_MAX) {
+    char b[3] = {(char) tag16, (char) (len >> 8), (char) len};
+    rb_str_cat(rb_buf, b, sizeof(b));
+  } else {
+    char b[5] = {(char) tag32, (char) (len >> 24), (char) (len >> 16), (char) (len >> 8), (char) len};
+    rb_str_cat(rb_buf, b, sizeof(b));
+  }
+}
+
+static void
+msgpack_write_str(VALUE rb_buf, const char *str, size_t len) {
+  if(len < 32) {
+    char c = (char) (0xa0 | len);
+    rb_str_cat(rb_buf, &c, 1);
+  } else if(len <= UINT8_MAX) {
+    char b[2] = {(char) 0xd9, (char) len};
+    rb_str_cat(rb_buf, b, sizeof(b));
+  } else {
+    msgpack_write_header(rb_buf, 0, 0, 0xda, 0xdb, (uint32_t) len);
+  }
+  rb_str_cat(rb_buf, str, len);
+}
+
+static void
+msgpack_write_uint(VALUE rb_buf, uint32_t v) {
+  if(v < 128) {
+    char c = (char) v;
+    rb_str_cat(rb_buf, &c, 1);
+  } else if(v <= UINT8_MAX) {
+    char b[2] = {(char) 0xcc, (char) v};
+    rb_str_cat(rb_buf, b, sizeof(b));
+  } else if(v <= UINT16_MAX) {
+    char b[3] = {(char) 0xcd, (char) (v >> 8), (char) v};
+    rb_str_cat(rb_buf, b, sizeof(b));
+  } else {
+    char b[5] = {(char) 0xce, (char) (v >> 24), (char) (v >> 16), (char) (v >> 8), (char) v};
+    rb_str_cat(rb_buf, b, sizeof(b));
+  }
+}
+
+static void
+json_write_str(VALUE rb_buf, const char *str, size_t len) {
+  STR_CAT_STATIC(rb_buf, "\"");
+  json_escape_str(rb_buf, str, len, true);
+  STR_CAT_STATIC(rb_buf, "\"");
+}
+
+static inline bool
+node_serializer_include(NodeSerializer *serializer, TSNode node) {
+  return serializer->unnamed || ts_node_is_named(node);
+}
+
+// Writes everything of the cursor's current node up to its children.
+// Returns the number of children to be written.
+static uint32_t
+node_serializer_write_head(NodeSerializer *serializer) {
+  VALUE rb_buf = serializer->rb_buf;
+  TSNode node = ts_tree_cursor_current_node(&serializer->cursor);
+  const char *type = ts_node_type(node);
+  const char *field_name = ts_tree_cursor_current_field_name(&serializer->cursor);
+  uint32_t child_count = serializer->unnamed ? ts_node_child_count(node) : ts_node_named_child_count(node);
+  bool text = child_count == 0 && !NIL_P(serializer->tree->rb_input);
+  bool byte_range = !text && serializer->byte_ranges;
+  uint32_t start_byte = ts_node_start_byte(node);
+  uint32_t end_byte = ts_node_end_byte(node);
+
+  const char *input = NULL;
+  size_t text_len = 0;
+  if(text) {
+    input = RSTRING_PTR(serializer->tree->rb_input);
+    size_t input_len = RSTRING_LEN(serializer->tree->rb_input);
+    start_byte = MIN(start_byte, input_len);
+    end_byte = MIN(end_byte, input_len);
+    text_len = end_byte - start_byte;
+  }
+
+  if(serializer->format == NODE_SERIALIZE_MSGPACK) {
+    msgpack_write_header(rb_buf, 0x80, 15, 0xde, 0xdf, 1 + (text || byte_range) + (field_name != NULL) + (child_count > 0));
+    msgpack_write_str(rb_buf, "type", 4);
+    if(type != NULL) {
+      msgpack_write_str(rb_buf, type, strlen(type));
+    } else {
+      STR_CAT_STATIC(rb_buf, "\xc0");
+    }
+    if(text) {
+      msgpack_write_str(rb_buf, "text", 4);
+      msgpack_write_str(rb_buf, input + start_byte, text_len);
+    } else if(byte_range) {
+      msgpack_write_str(rb_buf, "byte_range", 10);
+      msgpack_write_header(rb_buf, 0x90, 15, 0xdc, 0xdd, 2);
+      msgpack_write_uint(rb_buf, start_byte);
+      if(end_byte == 0) {
+        STR_CAT_STATIC(rb_buf, "\xff");
+      } else {
+        msgpack_write_uint(rb_buf, end_byte - 1);
+      }
+    }
+    if(field_name != NULL) {
+      msgpack_write_str(rb_buf, "field", 5);
+      msgpack_write_str(rb_buf, field_name, strlen(field_name));
+    }
+    if(child_count > 0) {
+      msgpack_write_str(rb_buf, "children", 8);
+      msgpack_write_header(rb_buf, 0x90, 15, 0xdc, 0xdd, child_count);
+    }
+  } else {
+    STR_CAT_STATIC(rb_buf, "{\"type\":");
+    if(type != NULL) {
+      json_write_str(rb_buf, type, strlen(type));
+    } else {
+      STR_CAT_STATIC(rb_buf, "null");
+    }
+    if(text) {
+      STR_CAT_STATIC(rb_buf, ",\"text\":");
+      json_write_str(rb_buf, input + start_byte, text_len);
+    } else if(byte_range) {
+      STR_CAT_STATIC(rb_buf, ",\"byte_range\":[");
+      _rb_str_cat_u32(rb_buf, start_byte);
+      STR_CAT_STATIC(rb_buf, ",");
+      if(end_byte == 0) {
+        STR_CAT_STATIC(rb_buf, "-1");
+      } else {
+        _rb_str_cat_u32(rb_buf, end_byte - 1);
+      }
+      STR_CAT_STATIC(rb_buf, "]");
+    }
+    if(field_name != NULL) {
+      STR_CAT_STATIC(rb_buf, ",\"field\":");
+      json_write_str(rb_buf, field_name, strlen(field_name));
+    }
+    if(child_count > 0) {
+      STR_CAT_STATIC(rb_buf, ",\"children\":[");
+    } else {
+      STR_CAT_STATIC(rb_buf, "}");
+    }
+  }
+  return child_count;
+}
+
+static bool
+node_serializer_goto_next_included_sibling(NodeSerializer *serializer) {
+  while(ts_tree_cursor_goto_next_sibling(&serializer->cursor)) {
+    if(node_serializer_include(serializer, ts_tree_cursor_current_node(&serializer->cursor))) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static VALUE
+node_serializer_run(VALUE arg) {
+  NodeSerializer *serializer = (NodeSerializer *) arg;
+  bool json = serializer->format == NODE_SERIALIZE_JSON;
+
+  while(true) {
+    node_serializer_flush(serializer, false);
+
+    if(node_serializer_write_head(serializer) > 0) {
+      // at least one child is included, otherwise the child count would be 0
+      ts_tree_cursor_goto_first_child(&serializer->cursor);
+      if(node_serializer_include(serializer, ts_tree_cursor_current_node(&serializer->cursor)) ||
+         node_serializer_goto_next_included_sibling(serializer)) {
+        continue;
+      }
+    }
+
+    while(!node_serializer_goto_next_included_sibling(serializer)) {
+      if(!ts_tree_cursor_goto_parent(&serializer->cursor)) {
+        node_serializer_flush(serializer, true);
+        return Qnil;
+      }
+      if(json) STR_CAT_STATIC(serializer->rb_buf, "]}");
+    }
+    if(json) STR_CAT_STATIC(serializer->rb_buf, ",");
+  }
+}
+
+static VALUE
+node_serializer_ensure(VALUE arg) {
+  NodeSerializer *serializer = (NodeSerializer *) arg;
+  ts_tree_cursor_delete(&serializer->cursor);
+  return Qnil;
+}
+
+VALUE
+node_serialize(TSNode node, Tree *tree, VALUE rb_io, NodeSerializeFormat format, bool byte_ranges, bool unnamed) {
+  NodeSerializer serializer = {
+    .node = node,
+    .tree = tree,
+    .rb_buf = rb_str_buf_new(NODE_SERIALIZE_FLUSH_SIZE),
+    .rb_io = rb_io,
+    .format = format,
+    .byte_ranges = byte_ranges,
+    .unnamed = unnamed,
+  };
+  rb_enc_associate(serializer.rb_buf, format == NODE_SERIALIZE_JSON ? rb_utf8_encoding() : rb_ascii8bit_encoding());
+  serializer.cursor = ts_tree_cursor_new(node);
+
+  rb_ensure(node_serializer_run, (VALUE) &serializer, node_serializer_ensure, (VALUE) &serializer);
+  return NIL_P(rb_io) ? serializer.rb_buf : rb_io;
+}
+
 static int
 subtree_counter_entry_with_id_cmp(const void* a, const void* b)
 {
@@ -857,6 +1118,247 @@ rb_subtree_counter_entry_to_json(VALUE self, VALUE rb_type_id, VALUE rb_field_id
   return rb_buf;
 }
 
+/*
+ * Structural (Merkle) hashes
+ *
+ * A node's hash covers its type, the text of leaves (optionally) and, in order,
+ * the hashes and field ids of its children. The node's own field is not part of
+ * its hash, so identical subtrees hash to the same value regardless of where they
+ * appear. Unlike subtree_counter_entry_hash this does not use rb_memhash, which is
+ * seeded per process, so hashes can be cached and compared across processes (as long
+ * as the grammar is the same).
+ */
+
+#define STRUCTURAL_HASH_SEED_LO 0x243f6a8885a308d3ULL
+#define STRUCTURAL_HASH_SEED_HI 0x13198a2e03707344ULL
+
+typedef struct {
+  uint64_t lo;
+  uint64_t hi;
+  uint32_t child_count;
+  uint32_t index;
+  bool skip;
+} StructuralHashFrame;
+
+static inline uint64_t
+structural_hash_fmix(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static inline uint64_t
+structural_hash_combine(uint64_t h, uint64_t v) {
+  return structural_hash_fmix(h ^ (v + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2)));
+}
+
+static uint64_t
+structural_hash_text(uint64_t h, const char *text, uint32_t len) {
+  uint32_t i = 0;
+  for(; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, text + i, 8);
+    h = structural_hash_combine(h, word);
+  }
+  if(i < len) {
+    uint64_t word = 0;
+    memcpy(&word, text + i, len - i);
+    h = structural_hash_combine(h, word);
+  }
+  return structural_hash_combine(h, len);
+}
+
+static void
+structural_hash_enter(StructuralHashFrame *frame, StructuralHashOptions *options, TSNode node) {
+  TSSymbol symbol = ts_node_symbol(node);
+  frame->child_count = 0;
+  frame->hi = 0;
+  frame->skip = !structural_hash_use_type(options, symbol);
+  if(frame->skip) {
+    return;
+  }
+
+  frame->lo = structural_hash_combine(STRUCTURAL_HASH_SEED_LO, symbol);
+  if(options->wide) {
+    frame->hi = structural_hash_combine(STRUCTURAL_HASH_SEED_HI, symbol);
+  }
+
+  if(options->input != NULL && ts_node_child_count(node) == 0) {
+    uint32_t start_byte = ts_node_start_byte(node);
+    uint32_t end_byte = ts_node_end_byte(node);
+    assert(end_byte <= options->input_len);
+    frame->lo = structural_hash_text(frame->lo, options->input + start_byte, end_byte - start_byte);
+    if(options->wide) {
+      frame->hi = structural_hash_text(frame->hi, options->input + start_byte, end_byte - start_byte);
+    }
+  }
+}
+
+static void
+structural_hash_fold(StructuralHashFrame *parent, StructuralHashFrame *child, TSFieldId field_id, bool wide) {
+  parent->lo = structural_hash_combine(structural_hash_combine(parent->lo, field_id), child->lo);
+  if(wide) {
+    parent->hi = structural_hash_combine(structural_hash_combine(parent->hi, field_id), child->hi);
+  }
+  parent->child_count++;
+}
+
+static void
+structural_hash_leave(StructuralHashFrame *frame, bool wide) {
+  frame->lo = structural_hash_fmix(frame->lo ^ frame->child_count);
+  if(wide) {
+    frame->hi = structural_hash_fmix(frame->hi ^ ((uint64_t) frame->child_count << 32));
+  }
+}
+
+bool
+structural_hash_use_type(StructuralHashOptions *options, TSSymbol symbol) {
+  if(options->types_len == -1) {
+    return true;
+  }
+  uint16_t key = symbol;
+  return bsearch(&key, options->types, options->types_len, sizeof(uint16_t), symbol_cmp) != NULL;
+}
+
+void
+structural_hash_options_init(StructuralHashOptions *options, Tree *tree, VALUE rb_include_text, VALUE rb_types, VALUE rb_bits) {
+  options->input = NULL;
+  options->input_len = 0;
+  options->types = NULL;
+  options->types_len = -1;
+  options->wide = false;
+
+  if(!RB_NIL_P(rb_bits)) {
+    int bits = NUM2INT(rb_bits);
+    if(bits != 64 && bits != 128) {
+      rb_raise(rb_eArgError, "bits must be 64 or 128");
+    }
+    options->wide = bits == 128;
+  }
+
+  if(RTEST(rb_include_text)) {
+    if(NIL_P(tree->rb_input)) {
+      rb_raise(rb_eTreeSitterError, "no input attached");
+    }
+    options->input = RSTRING_PTR(tree->rb_input);
+    options->input_len = RSTRING_LEN(tree->rb_input);
+  }
+
+  if(!RB_NIL_P(rb_types)) {
+    Check_Type(rb_types, T_ARRAY);
+    size_t types_len = (size_t) RARRAY_LEN(rb_types);
+    // type errors are raised before types is allocated
+    for(size_t i = 0; i < types_len; i++) {
+      Check_Type(RARRAY_AREF(rb_types, i), T_SYMBOL);
+    }
+    uint16_t *types = RB_ALLOC_N(uint16_t, types_len);
+
+    for(size_t i = 0; i < types_len; i++) {
+      VALUE rb_symbol = RARRAY_AREF(rb_types, i);
+      TSSymbol symbol;
+      if(language_id2symbol(tree->language, RB_SYM2ID(rb_symbol), &symbol)) {
+        types[i] = symbol;
+      } else {
+        xfree(types);
+        rb_raise(rb_eArgError, "invalid symbol %"PRIsVALUE"", rb_symbol);
+      }
+    }
+    qsort(types, types_len, sizeof(uint16_t), symbol_cmp);
+    options->types = types;
+    options->types_len = (ssize_t) types_len;
+  }
+}
+
+void
+structural_hash_options_destroy(StructuralHashOptions *options) {
+  xfree(options->types);
+}
+
+/*
+ * Computes the hash of node in a single bottom-up pass using one tree cursor.
+ * The type of node itself must not be filtered out by options.
+ * If out is not NULL, the hash of every (non-filtered) node is stored in preorder,
+ * out must then have room for at least the number of descendants of node (including node).
+ * Returns the number of hashed nodes.
+ */
+size_t
+structural_hash_node(TSNode node, StructuralHashOptions *options, StructuralHash *out, StructuralHash *root_hash) {
+  size_t stack_capa = 64;
+  size_t stack_len = 0;
+  StructuralHashFrame *stack = RB_ALLOC_N(StructuralHashFrame, stack_capa);
+  size_t count = 0;
+
+  TSTreeCursor cursor = ts_tree_cursor_new(node);
+
+  structural_hash_enter(&stack[stack_len++], options, node);
+  assert(!stack[0].skip);
+  stack[0].index = count++;
+
+  while(true) {
+    StructuralHashFrame *top = &stack[stack_len - 1];
+
+    if(top->skip || !ts_tree_cursor_goto_first_child(&cursor)) {
+      // no (more) children: finish nodes until we find a sibling to continue with
+      while(true) {
+        StructuralHashFrame frame = stack[--stack_len];
+
+        if(!frame.skip) {
+          structural_hash_leave(&frame, options->wide);
+          if(out != NULL) {
+            out[frame.index].lo = frame.lo;
+            out[frame.index].hi = frame.hi;
+          }
+
+          if(stack_len == 0) {
+            if(root_hash != NULL) {
+              root_hash->lo = frame.lo;
+              root_hash->hi = frame.hi;
+            }
+            goto done;
+          }
+
+          TSFieldId field_id = ts_tree_cursor_current_field_id(&cursor);
+          structural_hash_fold(&stack[stack_len - 1], &frame, field_id, options->wide);
+        }
+
+        if(ts_tree_cursor_goto_next_sibling(&cursor)) {
+          break;
+        }
+        ts_tree_cursor_goto_parent(&cursor);
+      }
+    }
+
+    if(stack_len == stack_capa) {
+      stack_capa *= 2;
+      RB_REALLOC_N(stack, StructuralHashFrame, stack_capa);
+    }
+
+    StructuralHashFrame *frame = &stack[stack_len++];
+    structural_hash_enter(frame, options, ts_tree_cursor_current_node(&cursor));
+    if(!frame->skip) {
+      frame->index = count++;
+    }
+  }
+
+done:
+  xfree(stack);
+  ts_tree_cursor_delete(&cursor);
+  return count;
+}
+
+VALUE
+structural_hash_to_rb(StructuralHash hash, bool wide) {
+  if(wide) {
+    uint64_t words[2] = {hash.lo, hash.hi};
+    return rb_integer_unpack(words, 2, sizeof(uint64_t), 0, INTEGER_PACK_LSWORD_FIRST | INTEGER_PACK_NATIVE_BYTE_ORDER);
+  } else {
+    return RB_ULL2NUM(hash.lo);
+  }
+}
+
 
 void
 init_misc() {
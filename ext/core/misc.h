@@ -46,4 +46,30 @@ typedef struct {
   SubtreeCounterEntry *entry;
 } SubtreeCounterEntryRb;
 
+typedef struct {
+  uint64_t lo;
+  uint64_t hi;
+} StructuralHash;
+
+typedef struct {
+  const char *input;
+  size_t input_len;
+  uint16_t *types;
+  ssize_t types_len;
+  bool wide;
+} StructuralHashOptions;
+
+void structural_hash_options_init(StructuralHashOptions *options, Tree *tree, VALUE rb_include_text, VALUE rb_types, VALUE rb_bits);
+void structural_hash_options_destroy(StructuralHashOptions *options);
+bool structural_hash_use_type(StructuralHashOptions *options, TSSymbol symbol);
+size_t structural_hash_node(TSNode node, StructuralHashOptions *options, StructuralHash *out, StructuralHash *root_hash);
+VALUE structural_hash_to_rb(StructuralHash hash, bool wide);
+
+typedef enum {
+  NODE_SERIALIZE_JSON,
+  NODE_SERIALIZE_MSGPACK,
+} NodeSerializeFormat;
+
+VALUE node_serialize(TSNode node, Tree *tree, VALUE rb_io, NodeSerializeFormat format, bool byte_ranges, bool unnamed);
+
 void init_misc();
\ No newline at end of file
@@ -0,0 +1,198 @@
+#include "name_map.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  const char *name;
+  size_t len;
+  uint16_t id;
+  uint32_t bucket;
+} NameMapKey;
+
+typedef struct {
+  uint32_t start;
+  uint32_t len;
+} NameMapBucket;
+
+static inline uint32_t
+name_hash(uint32_t seed, const char *name, size_t len)
+{
+  // FNV-1a, then murmur3's finalizer so consecutive seeds give unrelated hashes
+  uint32_t hash = 2166136261u ^ (seed * 0x9e3779b9u);
+  for(size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t) name[i];
+    hash *= 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static int
+name_map_key_cmp(const void *a, const void *b)
+{
+  uint32_t bucket_a = ((const NameMapKey *) a)->bucket;
+  uint32_t bucket_b = ((const NameMapKey *) b)->bucket;
+  return (bucket_a > bucket_b) - (bucket_a < bucket_b);
+}
+
+static int
+name_map_bucket_cmp(const void *a, const void *b)
+{
+  // largest first, they are the hardest to place
+  uint32_t len_a = ((const NameMapBucket *) a)->len;
+  uint32_t len_b = ((const NameMapBucket *) b)->len;
+  return (len_a < len_b) - (len_a > len_b);
+}
+
+typedef struct {
+  NameMapKey *keys;
+  uint32_t len;
+} NameMapCollect;
+
+static int
+name_map_collect(st_data_t key, st_data_t value, st_data_t arg)
+{
+  NameMapCollect *collect = (NameMapCollect *) arg;
+  const char *name = (const char *) key;
+  collect->keys[collect->len++] = (NameMapKey) {
+    .name = name,
+    .len = strlen(name),
+    .id = (uint16_t) value,
+  };
+  return ST_CONTINUE;
+}
+
+NameMap *
+name_map_new(const TSLanguage *ts_language, NameMapName name, uint32_t count)
+{
+  NameMap *map = RB_ZALLOC(NameMap);
+  map->ts_language = ts_language;
+  map->name = name;
+
+  // later ids overwrite earlier ones with the same name
+  st_table *names = st_init_strtable_with_size(count);
+  for(uint32_t id = 0; id < count; id++) {
+    const char *id_name = name(ts_language, (uint16_t) id);
+    if(id_name != NULL) {
+      st_insert(names, (st_data_t) id_name, (st_data_t) id);
+    }
+  }
+
+  NameMapCollect collect = {
+    .keys = RB_ALLOC_N(NameMapKey, names->num_entries + 1),
+    .len = 0,
+  };
+  st_foreach(names, name_map_collect, (st_data_t) &collect);
+  st_free_table(names);
+
+  uint32_t key_count = collect.len;
+  NameMapKey *keys = collect.keys;
+  if(key_count == 0) {
+    xfree(keys);
+    return map;
+  }
+
+  map->bucket_count = key_count / 2 + 1;
+  map->slot_count = key_count;
+  map->seeds = RB_ZALLOC_N(uint32_t, map->bucket_count);
+  map->slots = RB_ALLOC_N(uint16_t, map->slot_count);
+
+  for(uint32_t i = 0; i < key_count; i++) {
+    keys[i].bucket = name_hash(0, keys[i].name, keys[i].len) % map->bucket_count;
+  }
+  qsort(keys, key_count, sizeof(NameMapKey), name_map_key_cmp);
+
+  NameMapBucket *buckets = RB_ZALLOC_N(NameMapBucket, map->bucket_count);
+  for(uint32_t i = 0; i < key_count; i++) {
+    NameMapBucket *bucket = &buckets[keys[i].bucket];
+    if(bucket->len++ == 0) {
+      bucket->start = i;
+    }
+  }
+  qsort(buckets, map->bucket_count, sizeof(NameMapBucket), name_map_bucket_cmp);
+
+  bool *taken = RB_ZALLOC_N(bool, map->slot_count);
+  uint32_t *bucket_slots = RB_ALLOC_N(uint32_t, buckets[0].len);
+
+  for(uint32_t b = 0; b < map->bucket_count && buckets[b].len > 0; b++) {
+    NameMapBucket *bucket = &buckets[b];
+    NameMapKey *bucket_keys = &keys[bucket->start];
+
+    // there is always a free slot for every remaining key, so some seed
+    // places them all; the last (single key) buckets take about
+    // slot_count / free_slots tries
+    for(uint32_t seed = 1; ; seed++) {
+      uint32_t placed = 0;
+      for(; placed < bucket->len; placed++) {
+        uint32_t slot = name_hash(seed, bucket_keys[placed].name, bucket_keys[placed].len) % map->slot_count;
+        if(taken[slot]) {
+          break;
+        }
+        taken[slot] = true;
+        bucket_slots[placed] = slot;
+      }
+
+      if(placed == bucket->len) {
+        map->seeds[bucket_keys[0].bucket] = seed;
+        for(uint32_t i = 0; i < placed; i++) {
+          map->slots[bucket_slots[i]] = bucket_keys[i].id;
+        }
+        break;
+      }
+
+      for(uint32_t i = 0; i < placed; i++) {
+        taken[bucket_slots[i]] = false;
+      }
+    }
+  }
+
+  xfree(bucket_slots);
+  xfree(taken);
+  xfree(buckets);
+  xfree(keys);
+  return map;
+}
+
+void
+name_map_free(NameMap *map)
+{
+  if(map == NULL) {
+    return;
+  }
+  xfree(map->seeds);
+  xfree(map->slots);
+  xfree(map);
+}
+
+size_t
+name_map_memsize(const NameMap *map)
+{
+  if(map == NULL) {
+    return 0;
+  }
+  return sizeof(NameMap) + map->bucket_count * sizeof(uint32_t) + map->slot_count * sizeof(uint16_t);
+}
+
+bool
+name_map_lookup(const NameMap *map, const char *name, size_t len, uint16_t *id)
+{
+  if(map->slot_count == 0) {
+    return false;
+  }
+
+  uint32_t seed = map->seeds[name_hash(0, name, len) % map->bucket_count];
+  uint16_t candidate = map->slots[name_hash(seed, name, len) % map->slot_count];
+
+  const char *candidate_name = map->name(map->ts_language, candidate);
+  if(candidate_name == NULL || strncmp(candidate_name, name, len) != 0 || candidate_name[len] != '\0') {
+    return false;
+  }
+
+  *id = candidate;
+  return true;
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "ruby.h"
+#include "tree_sitter/api.h"
+
+// the names of a language's symbols or fields, by id
+typedef const char *(*NameMapName)(const TSLanguage *ts_language, uint16_t id);
+
+#define NAME_MAP_CACHE_SIZE 64
+
+// recent lookups by ID, so repeated lookups skip hashing the name
+typedef struct {
+  ID id;
+  uint16_t value;
+  bool found;
+} NameMapCacheEntry;
+
+// Minimal perfect hash from a language's symbol (or field) names to their
+// ids, built from the grammar's own name table without interning anything.
+// Keys are hashed into buckets, and each bucket gets a seed that sends all
+// of its keys to distinct slots, so a lookup hashes the name twice and
+// compares it against the single candidate. Names shared by several ids
+// (aliases) map to the highest one.
+typedef struct {
+  const TSLanguage *ts_language;
+  NameMapName name;
+  uint32_t bucket_count;
+  uint32_t slot_count;
+  uint32_t *seeds;
+  uint16_t *slots;
+  NameMapCacheEntry cache[NAME_MAP_CACHE_SIZE];
+} NameMap;
+
+NameMap *name_map_new(const TSLanguage *ts_language, NameMapName name, uint32_t count);
+void name_map_free(NameMap *map);
+size_t name_map_memsize(const NameMap *map);
+bool name_map_lookup(const NameMap *map, const char *name, size_t len, uint16_t *id);
+
+static inline bool
+name_map_lookup_id(NameMap *map, ID id, uint16_t *value)
+{
+  NameMapCacheEntry *entry = &map->cache[(id >> 4) % NAME_MAP_CACHE_SIZE];
+  if(RB_UNLIKELY(entry->id != id)) {
+    VALUE rb_name = rb_id2str(id);
+    if(!rb_name) {
+      return false;
+    }
+    entry->id = id;
+    entry->found = name_map_lookup(map, RSTRING_PTR(rb_name), RSTRING_LEN(rb_name), &entry->value);
+  }
+  if(entry->found) {
+    *value = entry->value;
+  }
+  return entry->found;
+}
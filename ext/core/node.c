@@ -11,6 +11,7 @@
 #include "ruby/internal/symbol.h"
 #include "ruby/ruby.h"
 #include "tree.h"
+#include "misc.h"
 #include "tree_sitter/api.h"
 #include <stdint.h>
 #include <stdlib.h>
@@ -60,12 +61,30 @@ static void token_free(void *t) {
 
 extern const rb_data_type_t tree_type;
 
+static size_t
+node_memsize(const void *obj)
+{
+  return sizeof(AstNode);
+}
+
+static size_t
+point_memsize(const void *obj)
+{
+  return sizeof(Point);
+}
+
+static size_t
+token_memsize(const void *obj)
+{
+  return sizeof(Token);
+}
+
 const rb_data_type_t node_type = {
     .wrap_struct_name = "Node",
     .function = {
         .dmark = node_mark,
         .dfree = node_free,
-        .dsize = NULL,
+        .dsize = node_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -76,7 +95,7 @@ static const rb_data_type_t point_type = {
     .function = {
         .dmark = NULL,
         .dfree = point_free,
-        .dsize = NULL,
+        .dsize = point_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -87,7 +106,7 @@ const rb_data_type_t token_type = {
     .function = {
         .dmark = token_mark,
         .dfree = token_free,
-        .dsize = NULL,
+        .dsize = token_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -270,7 +289,7 @@ rb_node_tree(VALUE self)
   return node->rb_tree;
 }
 
-static VALUE
+VALUE
 rb_new_point(TSPoint ts_point) {
   Point *point = RB_ALLOC(Point);
   point->ts_point = ts_point;
@@ -319,6 +338,82 @@ rb_node_end_point(VALUE self)
   return rb_new_point(end);
 }
 
+/*
+ * Public: Get the starting row of a node, without allocating a {Point}.
+ *
+ * Returns an {Integer}.
+ */
+static VALUE
+rb_node_start_row(VALUE self)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+  return UINT2NUM(ts_node_start_point(node->ts_node).row);
+}
+
+/*
+ * Public: Get the starting column (in bytes) of a node.
+ *
+ * Returns an {Integer}.
+ */
+static VALUE
+rb_node_start_column(VALUE self)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+  return UINT2NUM(ts_node_start_point(node->ts_node).column);
+}
+
+/*
+ * Public: Get the ending row of a node.
+ *
+ * Returns an {Integer}.
+ */
+static VALUE
+rb_node_end_row(VALUE self)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+  return UINT2NUM(ts_node_end_point(node->ts_node).row);
+}
+
+/*
+ * Public: Get the ending column (in bytes) of a node.
+ *
+ * Returns an {Integer}.
+ */
+static VALUE
+rb_node_end_column(VALUE self)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+  return UINT2NUM(ts_node_end_point(node->ts_node).column);
+}
+
+/*
+ * Public: Get all positions of a node at once.
+ *
+ * Returns a frozen {Array} of start byte, end byte, start row, start column,
+ * end row and end column.
+ */
+static VALUE
+rb_node_positions(VALUE self)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+
+  TSPoint start = ts_node_start_point(node->ts_node);
+  TSPoint end = ts_node_end_point(node->ts_node);
+  VALUE rb_positions = rb_ary_new_from_args(6,
+    UINT2NUM(ts_node_start_byte(node->ts_node)),
+    UINT2NUM(ts_node_end_byte(node->ts_node)),
+    UINT2NUM(start.row),
+    UINT2NUM(start.column),
+    UINT2NUM(end.row),
+    UINT2NUM(end.column));
+  return rb_ary_freeze(rb_positions);
+}
+
 /*
  * Public: Does the node have a name?
  *
@@ -387,13 +482,15 @@ rb_node_parents(VALUE self)
   TypedData_Get_Struct(self, AstNode, &node_type, node);
 
   VALUE rb_ary = rb_ary_new_capa(3);
-  const unsigned max_parents = 1024;
-  TSNode parent = node->ts_node;
-  for(unsigned i = 0; i < max_parents; i++) {
-    parent = ts_node_parent(parent);
-    if(ts_node_is_null(parent)) break;
-    rb_ary_push(rb_ary, rb_new_node(node->rb_tree, parent));
-  } 
+  TreeAncestorCache *cache = tree_ancestor_cache(node_get_tree(node));
+  uint32_t row;
+  if(!tree_ancestor_cache_row(cache, node->ts_node, &row)) {
+    return rb_ary;
+  }
+
+  for(int32_t parent = cache->parents[row]; parent >= 0; parent = cache->parents[parent]) {
+    rb_ary_push(rb_ary, rb_new_node_with_field(node->rb_tree, cache->nodes[parent], cache->fields[parent]));
+  }
 
   return rb_ary;
 }
@@ -404,13 +501,14 @@ rb_node_parent(VALUE self)
   AstNode *node;
   TypedData_Get_Struct(self, AstNode, &node_type, node);
 
-  TSNode parent = ts_node_parent(node->ts_node);
-
-  if (ts_node_is_null(parent)) {
+  TreeAncestorCache *cache = tree_ancestor_cache(node_get_tree(node));
+  uint32_t row;
+  if(!tree_ancestor_cache_row(cache, node->ts_node, &row) || cache->parents[row] < 0) {
     return Qnil;
-  } else {
-    return rb_new_node(node->rb_tree, parent);
   }
+
+  int32_t parent = cache->parents[row];
+  return rb_new_node_with_field(node->rb_tree, cache->nodes[parent], cache->fields[parent]);
 }
 
 /*
@@ -531,10 +629,10 @@ rb_node_dig(int argc, VALUE *argv, VALUE self) {
     VALUE rb_index_or_field = argv[i];
     switch(rb_type(rb_index_or_field)) {
       case RUBY_T_SYMBOL: {
-        st_data_t table_val;
+        TSFieldId field_id;
         ID id = RB_SYM2ID(rb_index_or_field);
-        if(st_lookup(language->ts_field_table, (st_data_t) id, &table_val)) {
-          TSNode child = ts_node_child_by_field_id(n, (TSFieldId) table_val);
+        if(language_id2field(language, id, &field_id)) {
+          TSNode child = ts_node_child_by_field_id(n, field_id);
           if(ts_node_is_null(child)) {
             return Qnil;
           } else {
@@ -571,6 +669,17 @@ rb_node_path_from_root(VALUE self) {
   return rb_tree_path_to(node->rb_tree, self);
 }
 
+/*
+ * Public: Checks the node's ancestry, innermost last.
+ * A field name checks the field of the current node within its parent,
+ * a type moves to the parent and checks its type.
+ *
+ * Example
+ *
+ *   name_node.has_ancestor_path?(:function_definition, :name)
+ *
+ * Returns a {Boolean}.
+ */
 static VALUE
 rb_node_ancestor_path_p(int argc, VALUE *argv, VALUE self) {
 
@@ -582,44 +691,52 @@ rb_node_ancestor_path_p(int argc, VALUE *argv, VALUE self) {
   TypedData_Get_Struct(self, AstNode, &node_type, node);
 
   Language *language = rb_tree_language_(node->rb_tree);
+  TreeAncestorCache *cache = tree_ancestor_cache(node_get_tree(node));
 
-  VALUE rb_retval = Qfalse;
-  Tree *tree = node_get_tree(node);
-
-  TSTreeCursor tree_cursor = ts_tree_cursor_new(ts_tree_root_node(tree->ts_tree));
-  // ts_tree_cursor_goto_first_child_for_byte(&tree_cursor,);
+  uint32_t row;
+  if(!tree_ancestor_cache_row(cache, node->ts_node, &row)) {
+    return Qfalse;
+  }
+  int32_t current = (int32_t) row;
 
-  for(int i = 0; i < argc; i++) {
-    VALUE sym = argv[argc - i - 1];
+  for(int i = argc - 1; i >= 0; i--) {
+    VALUE sym = argv[i];
     ID id = SYM2ID(sym);
-    st_data_t table_val;
-    bool found = false;
+    TSFieldId field_id;
+    TSSymbol symbol;
 
-    if(st_lookup(language->ts_field_table, (st_data_t) id, &table_val)) {
-      if(ts_tree_cursor_current_field_id(&tree_cursor) == (TSFieldId) table_val) {
-        found = true;
-      } else {
-        goto done;
+    if(language_id2field(language, id, &field_id)) {
+      if(cache->fields[current] != field_id) {
+        return Qfalse;
+      }
+    } else if(language_id2symbol(language, id, &symbol)) {
+      current = cache->parents[current];
+      if(current < 0 || language_symbol2id(language, ts_node_symbol(cache->nodes[current])) != id) {
+        return Qfalse;
       }
-    }
-
-    if(!ts_tree_cursor_goto_parent(&tree_cursor)) {
-      goto done;
-    }
-
-    if(!found && st_lookup(language->ts_symbol_table, (st_data_t) id, &table_val)) {
-      TSNode parent = ts_tree_cursor_current_node(&tree_cursor);
-      if(ts_node_symbol(parent) != (TSSymbol) table_val) {
-        goto done;
-      } 
     } else {
-      goto done;
+      return Qfalse;
     }
+  }
+
+  return Qtrue;
 }
 
-done:
-  ts_tree_cursor_delete(&tree_cursor);
-  return rb_retval; 
+static bool
+node_field_id(AstNode *node, TSFieldId *field_id) {
+  if(node->cached_field != 0) {
+    *field_id = node->cached_field;
+    return true;
+  }
+
+  TreeAncestorCache *cache = tree_ancestor_cache(node_get_tree(node));
+  uint32_t row;
+  if(!tree_ancestor_cache_row(cache, node->ts_node, &row)) {
+    return false;
+  }
+  *field_id = cache->fields[row];
+  node->cached_field = *field_id;
+  return *field_id != 0;
 }
 
 static VALUE
@@ -629,68 +746,28 @@ rb_node_field(VALUE self) {
 
   Language *language = rb_tree_language_(node->rb_tree);
 
-  if(node->cached_field != 0) {
-    ID id = language_field2id(language, node->cached_field);
-    return RB_ID2SYM(id);
-  }
-
-  TSNode parent_node = ts_node_parent(node->ts_node);
-  if(ts_node_is_null(parent_node)) {
+  TSFieldId field_id;
+  if(!node_field_id(node, &field_id)) {
     return Qnil;
   }
-
-  VALUE rb_retval = Qnil;
-
-  TSTreeCursor cursor = ts_tree_cursor_new(parent_node);
-  if(!ts_tree_cursor_goto_first_child(&cursor)) goto done;
-
-  while(ts_tree_cursor_goto_next_sibling(&cursor)) {
-    TSNode child_node = ts_tree_cursor_current_node(&cursor);
-    if(node->ts_node.id == child_node.id) {
-      TSFieldId field_id = ts_tree_cursor_current_field_id(&cursor);
-      if(field_id != 0) {
-        rb_retval = RB_ID2SYM(language_field2id(language, field_id));
-        goto done;
-      }
-    }
-  }
-
-done:
-  ts_tree_cursor_delete(&cursor);
-  return rb_retval;  
+  return RB_ID2SYM(language_field2id(language, field_id));
 }
 
 static VALUE
 rb_node_field_p_(AstNode *node, Language *language, int argc, VALUE *argv) {
-  if(node->cached_field != 0) {
-    ID node_field_id = language_field2id(language, node->cached_field);
-    for(int i = 0; i < argc; i++) {
-      VALUE rb_field = argv[i];
-      Check_Type(rb_field, T_SYMBOL);
-
-      ID field_id = SYM2ID(rb_field);
-      if(node_field_id == field_id) return Qtrue;
-    }
+  TSFieldId node_field_id_;
+  if(!node_field_id(node, &node_field_id_)) {
     return Qfalse;
-  } else {
-    TSNode parent_node = ts_node_parent(node->ts_node);
-    if(ts_node_is_null(parent_node)) {
-      return Qfalse;
-    }
+  }
 
-    for(int i = 0; i < argc; i++) {
-      VALUE rb_field = argv[i];
-      Check_Type(rb_field, T_SYMBOL);
+  ID node_field = language_field2id(language, node_field_id_);
+  for(int i = 0; i < argc; i++) {
+    VALUE rb_field = argv[i];
+    Check_Type(rb_field, T_SYMBOL);
 
-      ID field_id = SYM2ID(rb_field);
-      TSFieldId ts_field_id;
-      if(language_id2field(language, field_id, &ts_field_id)) {
-        TSNode child = ts_node_child_by_field_id(parent_node, ts_field_id);
-        if(child.id == node->ts_node.id) return Qtrue;
-      }
-    }
-    return Qfalse;
+    if(node_field == SYM2ID(rb_field)) return Qtrue;
   }
+  return Qfalse;
 }
 
 static VALUE
@@ -717,8 +794,8 @@ rb_node_child_by_field(VALUE self, VALUE rb_field) {
   Language *language = rb_tree_language_(node->rb_tree);
 
   ID id = SYM2ID(rb_field);
-  st_data_t field_id;
-  if(st_lookup(language->ts_field_table, (st_data_t) id, &field_id)) {
+  TSFieldId field_id;
+  if(language_id2field(language, id, &field_id)) {
     TSNode child = ts_node_child_by_field_id(node->ts_node, field_id);
     if(ts_node_is_null(child)) {
       return Qnil;
@@ -1877,16 +1954,22 @@ rb_node_pq_profile(VALUE self, VALUE rb_p, VALUE rb_q, VALUE rb_include_root_anc
 }
 
 static VALUE
-node_to_hash(TSTreeCursor *cursor, TSNode node, Tree* tree, bool include_byte_ranges, bool include_unnamed)
+node_to_hash(TSTreeCursor *cursor, TSNode node, Tree* tree, bool include_byte_ranges, bool include_unnamed, bool symbols)
 {
   VALUE rb_hash = rb_hash_new();
+  Language *language = tree->language;
 
-  const char* type = ts_node_type(node);
+  // types and fields are the frozen strings backing the language's interned IDs,
+  // so no string is allocated per node
+  TSSymbol symbol = ts_node_symbol(node);
   VALUE rb_type;
-  if (type != NULL) {
-    rb_type = rb_str_new2(type);
+  if(symbols) {
+    rb_type = RB_ID2SYM(language_symbol2id(language, symbol));
+  } else if(symbol < language->symbol_count) {
+    rb_type = rb_id2str(language_symbol2id(language, symbol));
   } else {
-    rb_type = Qnil;
+    const char* type = ts_node_type(node);
+    rb_type = type != NULL ? rb_interned_str_cstr(type) : Qnil;
   }
 
   rb_hash_aset(rb_hash, RB_ID2SYM(id_type), rb_type);
@@ -1909,10 +1992,10 @@ node_to_hash(TSTreeCursor *cursor, TSNode node, Tree* tree, bool include_byte_ra
     }
   }
 
-  const char *field_name = ts_tree_cursor_current_field_name(cursor);
-  if (field_name) {
-    VALUE rb_field_name = rb_str_new_cstr(field_name);
-    rb_hash_aset(rb_hash, RB_ID2SYM(id_field), rb_field_name);
+  TSFieldId field_id = ts_tree_cursor_current_field_id(cursor);
+  if (field_id != 0) {
+    ID field = language_field2id(language, field_id);
+    rb_hash_aset(rb_hash, RB_ID2SYM(id_field), symbols ? RB_ID2SYM(field) : rb_id2str(field));
   }
 
   if (child_count > 0) {
@@ -1922,7 +2005,7 @@ node_to_hash(TSTreeCursor *cursor, TSNode node, Tree* tree, bool include_byte_ra
         TSNode child_node = ts_tree_cursor_current_node(cursor);
         TSTreeCursor child_cursor = ts_tree_cursor_copy(cursor);
         if(include_unnamed || ts_node_is_named(child_node)) {
-          VALUE rb_child_hash = node_to_hash(&child_cursor, child_node, tree, include_byte_ranges, include_unnamed);
+          VALUE rb_child_hash = node_to_hash(&child_cursor, child_node, tree, include_byte_ranges, include_unnamed, symbols);
           rb_ary_push(rb_children, rb_child_hash);
         }
         ts_tree_cursor_delete(&child_cursor);
@@ -1938,19 +2021,322 @@ node_to_hash(TSTreeCursor *cursor, TSNode node, Tree* tree, bool include_byte_ra
 }
 
 static VALUE
-rb_node_to_h(VALUE self, VALUE rb_byte_ranges, VALUE rb_unnamed)
+rb_node_serialize(VALUE self, VALUE rb_io, VALUE rb_byte_ranges, VALUE rb_unnamed, NodeSerializeFormat format)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+
+  return node_serialize(node->ts_node, node_get_tree(node), rb_io, format, RTEST(rb_byte_ranges), RTEST(rb_unnamed));
+}
+
+static VALUE
+rb_node_to_json_(VALUE self, VALUE rb_io, VALUE rb_byte_ranges, VALUE rb_unnamed)
+{
+  return rb_node_serialize(self, rb_io, rb_byte_ranges, rb_unnamed, NODE_SERIALIZE_JSON);
+}
+
+static VALUE
+rb_node_to_msgpack_(VALUE self, VALUE rb_io, VALUE rb_byte_ranges, VALUE rb_unnamed)
+{
+  return rb_node_serialize(self, rb_io, rb_byte_ranges, rb_unnamed, NODE_SERIALIZE_MSGPACK);
+}
+
+static VALUE
+rb_node_to_h(VALUE self, VALUE rb_byte_ranges, VALUE rb_unnamed, VALUE rb_symbols)
 {
   AstNode *node;
   TypedData_Get_Struct(self, AstNode, &node_type, node);
   TSTreeCursor cursor = ts_tree_cursor_new(node->ts_node);
 
   Tree *tree = node_get_tree(node);
-  VALUE rb_hash = node_to_hash(&cursor, node->ts_node, tree, RB_TEST(rb_byte_ranges), RB_TEST(rb_unnamed));
+  VALUE rb_hash = node_to_hash(&cursor, node->ts_node, tree, RB_TEST(rb_byte_ranges), RB_TEST(rb_unnamed), RB_TEST(rb_symbols));
 
   ts_tree_cursor_delete(&cursor);
   return rb_hash;
 }
 
+static VALUE
+rb_node_structural_hash(VALUE self, VALUE rb_include_text, VALUE rb_types, VALUE rb_bits)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+
+  Tree *tree = node_get_tree(node);
+
+  StructuralHashOptions options;
+  structural_hash_options_init(&options, tree, rb_include_text, rb_types, rb_bits);
+
+  if(!structural_hash_use_type(&options, ts_node_symbol(node->ts_node))) {
+    structural_hash_options_destroy(&options);
+    rb_raise(rb_eArgError, "the node's type must be in types");
+  }
+
+  StructuralHash hash;
+  structural_hash_node(node->ts_node, &options, NULL, &hash);
+  structural_hash_options_destroy(&options);
+
+  return structural_hash_to_rb(hash, options.wide);
+}
+
+typedef struct {
+  VALUE rb_tree;
+  TSTreeCursor cursor;
+  uint64_t *types;
+  size_t symbol_count;
+  bool match_error;
+  bool named_only;
+  uint32_t max_depth;
+  TSFieldId field_id;
+  VALUE rb_result;
+} DescendantSearch;
+
+static void
+descendant_search_init_types(DescendantSearch *search, Language *language, VALUE rb_types) {
+  if(NIL_P(rb_types)) {
+    return;
+  }
+
+  if(RB_SYMBOL_P(rb_types)) {
+    rb_types = rb_ary_new_from_args(1, rb_types);
+  }
+  Check_Type(rb_types, T_ARRAY);
+  // type errors are raised before the bitset is allocated
+  for(long i = 0; i < RARRAY_LEN(rb_types); i++) {
+    Check_Type(RARRAY_AREF(rb_types, i), T_SYMBOL);
+  }
+
+  // the bitset has one bit per symbol, aliased symbols share a name
+  search->types = RB_ZALLOC_N(uint64_t, (language->symbol_count + 63) / 64);
+  search->symbol_count = language->symbol_count;
+  for(long i = 0; i < RARRAY_LEN(rb_types); i++) {
+    VALUE rb_type = RARRAY_AREF(rb_types, i);
+    ID id = RB_SYM2ID(rb_type);
+    bool found = false;
+
+    if(id == id_error) {
+      search->match_error = true;
+      found = true;
+    }
+
+    // compare names rather than IDs so the other symbols stay uninterned
+    VALUE rb_name = rb_sym2str(rb_type);
+    for(size_t symbol = 0; symbol < language->symbol_count; symbol++) {
+      const char *name = ts_language_symbol_name(language->ts_language, (TSSymbol) symbol);
+      if(name != NULL && strlen(name) == (size_t) RSTRING_LEN(rb_name) &&
+         memcmp(name, RSTRING_PTR(rb_name), RSTRING_LEN(rb_name)) == 0) {
+        search->types[symbol / 64] |= UINT64_C(1) << (symbol % 64);
+        found = true;
+      }
+    }
+
+    if(!found) {
+      xfree(search->types);
+      search->types = NULL;
+      rb_raise(rb_eArgError, "invalid type %"PRIsVALUE"", rb_type);
+    }
+  }
+}
+
+static inline bool
+descendant_search_match(DescendantSearch *search, TSNode ts_node) {
+  if(search->named_only && !ts_node_is_named(ts_node)) {
+    return false;
+  }
+
+  if(search->field_id != 0 && ts_tree_cursor_current_field_id(&search->cursor) != search->field_id) {
+    return false;
+  }
+
+  if(search->types != NULL) {
+    TSSymbol symbol = ts_node_symbol(ts_node);
+    if(symbol == ((TSSymbol) -1)) {
+      return search->match_error;
+    }
+    return symbol < search->symbol_count && ((search->types[symbol / 64] >> (symbol % 64)) & 1);
+  }
+  return true;
+}
+
+static VALUE
+descendant_search_run(VALUE arg) {
+  DescendantSearch *search = (DescendantSearch *) arg;
+  TSTreeCursor *cursor = &search->cursor;
+  uint32_t depth = 0;
+
+  while(true) {
+    if(depth < search->max_depth && ts_tree_cursor_goto_first_child(cursor)) {
+      depth++;
+    } else {
+      while(!ts_tree_cursor_goto_next_sibling(cursor)) {
+        if(depth == 0 || !ts_tree_cursor_goto_parent(cursor)) {
+          return Qnil;
+        }
+        depth--;
+      }
+      if(depth == 0) {
+        return Qnil;
+      }
+    }
+
+    TSNode ts_node = ts_tree_cursor_current_node(cursor);
+    if(descendant_search_match(search, ts_node)) {
+      VALUE rb_node = rb_new_node_with_field(search->rb_tree, ts_node, ts_tree_cursor_current_field_id(cursor));
+      if(NIL_P(search->rb_result)) {
+        rb_yield(rb_node);
+      } else {
+        rb_ary_push(search->rb_result, rb_node);
+      }
+    }
+  }
+}
+
+static VALUE
+descendant_search_free(VALUE arg) {
+  DescendantSearch *search = (DescendantSearch *) arg;
+  ts_tree_cursor_delete(&search->cursor);
+  xfree(search->types);
+  return Qnil;
+}
+
+static VALUE
+rb_node_each_descendant_(VALUE self, VALUE rb_types, VALUE rb_field, VALUE rb_named_only, VALUE rb_max_depth, VALUE rb_collect)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+  Language *language = rb_tree_language_(node->rb_tree);
+
+  DescendantSearch search = {
+    .rb_tree = node->rb_tree,
+    .types = NULL,
+    .match_error = false,
+    .named_only = RTEST(rb_named_only),
+    .max_depth = NIL_P(rb_max_depth) ? UINT32_MAX : NUM2UINT(rb_max_depth),
+    .field_id = 0,
+    .rb_result = RTEST(rb_collect) ? rb_ary_new() : Qnil,
+  };
+
+  if(!NIL_P(rb_field)) {
+    Check_Type(rb_field, T_SYMBOL);
+    if(!language_id2field(language, RB_SYM2ID(rb_field), &search.field_id)) {
+      rb_raise(rb_eArgError, "invalid field %"PRIsVALUE"", rb_field);
+    }
+  }
+
+  descendant_search_init_types(&search, language, rb_types);
+  search.cursor = ts_tree_cursor_new(node->ts_node);
+
+  rb_ensure(descendant_search_run, (VALUE) &search, descendant_search_free, (VALUE) &search);
+  return NIL_P(search.rb_result) ? self : search.rb_result;
+}
+
+enum {
+  NODE_TABLE_FLAG_NAMED = 1 << 0,
+  NODE_TABLE_FLAG_MISSING = 1 << 1,
+  NODE_TABLE_FLAG_EXTRA = 1 << 2,
+  NODE_TABLE_FLAG_ERROR = 1 << 3,
+  NODE_TABLE_FLAG_HAS_ERROR = 1 << 4,
+};
+
+#define NODE_TABLE_COLUMN(name, type) \
+  VALUE rb_##name = rb_str_buf_new((long) (capa * sizeof(type))); \
+  type *name = (type *) RSTRING_PTR(rb_##name);
+
+#define NODE_TABLE_FINISH_COLUMN(name, type) \
+  rb_str_set_len(rb_##name, (long) (len * sizeof(type))); \
+  rb_obj_freeze(rb_##name); \
+  rb_hash_aset(rb_table, ID2SYM(rb_intern(#name)), rb_##name);
+
+static VALUE
+rb_node_descendants_table(VALUE self, VALUE rb_named_only)
+{
+  AstNode *node;
+  TypedData_Get_Struct(self, AstNode, &node_type, node);
+
+  bool named_only = RTEST(rb_named_only);
+  uint32_t capa = ts_node_descendant_count(node->ts_node);
+
+  NODE_TABLE_COLUMN(symbols, uint16_t);
+  NODE_TABLE_COLUMN(fields, uint16_t);
+  NODE_TABLE_COLUMN(parents, int32_t);
+  NODE_TABLE_COLUMN(start_bytes, uint32_t);
+  NODE_TABLE_COLUMN(end_bytes, uint32_t);
+  NODE_TABLE_COLUMN(start_rows, uint32_t);
+  NODE_TABLE_COLUMN(start_columns, uint32_t);
+  NODE_TABLE_COLUMN(end_rows, uint32_t);
+  NODE_TABLE_COLUMN(end_columns, uint32_t);
+  NODE_TABLE_COLUMN(flags, uint8_t);
+
+  // parent row index for each cursor depth
+  uint32_t stack_capa = 32;
+  int32_t *stack = RB_ALLOC_N(int32_t, stack_capa);
+  uint32_t depth = 0;
+  uint32_t len = 0;
+  stack[0] = -1;
+
+  TSTreeCursor cursor = ts_tree_cursor_new(node->ts_node);
+  while(true) {
+    TSNode ts_node = ts_tree_cursor_current_node(&cursor);
+    int32_t parent_index = stack[depth];
+
+    if(!named_only || ts_node_is_named(ts_node)) {
+      TSPoint start_point = ts_node_start_point(ts_node);
+      TSPoint end_point = ts_node_end_point(ts_node);
+
+      symbols[len] = ts_node_symbol(ts_node);
+      fields[len] = ts_tree_cursor_current_field_id(&cursor);
+      parents[len] = stack[depth];
+      start_bytes[len] = ts_node_start_byte(ts_node);
+      end_bytes[len] = ts_node_end_byte(ts_node);
+      start_rows[len] = start_point.row;
+      start_columns[len] = start_point.column;
+      end_rows[len] = end_point.row;
+      end_columns[len] = end_point.column;
+      flags[len] = (ts_node_is_named(ts_node) ? NODE_TABLE_FLAG_NAMED : 0) |
+                   (ts_node_is_missing(ts_node) ? NODE_TABLE_FLAG_MISSING : 0) |
+                   (ts_node_is_extra(ts_node) ? NODE_TABLE_FLAG_EXTRA : 0) |
+                   (ts_node_is_error(ts_node) ? NODE_TABLE_FLAG_ERROR : 0) |
+                   (ts_node_has_error(ts_node) ? NODE_TABLE_FLAG_HAS_ERROR : 0);
+      parent_index = (int32_t) len++;
+    }
+
+    if(ts_tree_cursor_goto_first_child(&cursor)) {
+      if(++depth == stack_capa) {
+        stack_capa *= 2;
+        RB_REALLOC_N(stack, int32_t, stack_capa);
+      }
+      stack[depth] = parent_index;
+      continue;
+    }
+
+    while(!ts_tree_cursor_goto_next_sibling(&cursor)) {
+      if(!ts_tree_cursor_goto_parent(&cursor)) {
+        goto done;
+      }
+      depth--;
+    }
+  }
+
+done:
+  ts_tree_cursor_delete(&cursor);
+  xfree(stack);
+
+  VALUE rb_table = rb_hash_new();
+  rb_hash_aset(rb_table, ID2SYM(rb_intern("size")), UINT2NUM(len));
+  NODE_TABLE_FINISH_COLUMN(symbols, uint16_t);
+  NODE_TABLE_FINISH_COLUMN(fields, uint16_t);
+  NODE_TABLE_FINISH_COLUMN(parents, int32_t);
+  NODE_TABLE_FINISH_COLUMN(start_bytes, uint32_t);
+  NODE_TABLE_FINISH_COLUMN(end_bytes, uint32_t);
+  NODE_TABLE_FINISH_COLUMN(start_rows, uint32_t);
+  NODE_TABLE_FINISH_COLUMN(start_columns, uint32_t);
+  NODE_TABLE_FINISH_COLUMN(end_rows, uint32_t);
+  NODE_TABLE_FINISH_COLUMN(end_columns, uint32_t);
+  NODE_TABLE_FINISH_COLUMN(flags, uint8_t);
+  return rb_table;
+}
+
+#undef NODE_TABLE_COLUMN
+#undef NODE_TABLE_FINISH_COLUMN
 
 void init_node(void)
 {
@@ -1991,6 +2377,11 @@ void init_node(void)
   rb_define_method(rb_cNode, "named_child_at?", rb_node_named_child_at_p, 2);
   rb_define_method(rb_cNode, "start_point", rb_node_start_point, 0);
   rb_define_method(rb_cNode, "end_point", rb_node_end_point, 0);
+  rb_define_method(rb_cNode, "start_row", rb_node_start_row, 0);
+  rb_define_method(rb_cNode, "start_column", rb_node_start_column, 0);
+  rb_define_method(rb_cNode, "end_row", rb_node_end_row, 0);
+  rb_define_method(rb_cNode, "end_column", rb_node_end_column, 0);
+  rb_define_method(rb_cNode, "positions", rb_node_positions, 0);
   rb_define_alias(rb_cNode, "start_position", "start_point");
   rb_define_alias(rb_cNode, "end_position", "end_point");
   rb_define_method(rb_cNode, "children", rb_node_children, 0);
@@ -2008,11 +2399,22 @@ void init_node(void)
   rb_define_method(rb_cNode, "hash", rb_node_hash, 0);
   rb_define_method(rb_cNode, "eql?", rb_node_eq, 1);
   rb_define_method(rb_cNode, "descendant_of_type?", rb_node_descendant_of_type, 1);
-  rb_define_private_method(rb_cNode, "__to_h__", rb_node_to_h, 2);
+  rb_define_private_method(rb_cNode, "__to_h__", rb_node_to_h, 3);
   rb_define_method(rb_cNode, "text?", rb_node_text_p, -1);
   rb_define_method(rb_cNode, "type?", rb_node_type_p, -1);
   rb_define_method(rb_cNode, "comment?", rb_node_comment_p, 0);
   rb_define_method(rb_cNode, "__pq_profile__", rb_node_pq_profile, 5);
+  rb_define_private_method(rb_cNode, "__structural_hash__", rb_node_structural_hash, 3);
+  rb_define_private_method(rb_cNode, "__descendants_table__", rb_node_descendants_table, 1);
+  rb_define_private_method(rb_cNode, "__to_json__", rb_node_to_json_, 3);
+  rb_define_private_method(rb_cNode, "__to_msgpack__", rb_node_to_msgpack_, 3);
+  rb_define_private_method(rb_cNode, "__each_descendant__", rb_node_each_descendant_, 5);
+
+  rb_define_const(rb_cNode, "TABLE_FLAG_NAMED", INT2FIX(NODE_TABLE_FLAG_NAMED));
+  rb_define_const(rb_cNode, "TABLE_FLAG_MISSING", INT2FIX(NODE_TABLE_FLAG_MISSING));
+  rb_define_const(rb_cNode, "TABLE_FLAG_EXTRA", INT2FIX(NODE_TABLE_FLAG_EXTRA));
+  rb_define_const(rb_cNode, "TABLE_FLAG_ERROR", INT2FIX(NODE_TABLE_FLAG_ERROR));
+  rb_define_const(rb_cNode, "TABLE_FLAG_HAS_ERROR", INT2FIX(NODE_TABLE_FLAG_HAS_ERROR));
 
   rb_cPoint = rb_define_class_under(rb_cNode, "Point", rb_cObject);
   rb_undef_alloc_func(rb_cPoint);
@@ -35,5 +35,6 @@ VALUE rb_node_byte_range_(TSNode node);
 VALUE rb_node_text_(TSNode ts_node, Tree *tree);
 VALUE rb_new_node(VALUE rb_tree, TSNode ts_node);
 VALUE rb_new_node_with_field(VALUE rb_tree, TSNode ts_node, TSFieldId field_id);
+VALUE rb_new_point(TSPoint ts_point);
 TSPoint rb_point_point_(VALUE rb_point);
 Tree *node_get_tree(AstNode *node);
\ No newline at end of file
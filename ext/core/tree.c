@@ -1,17 +1,34 @@
 #include "tree.h"
 #include "common.h"
+#include "misc.h"
 #include "tree_sitter/api.h"
 #include <wctype.h>
+#include <stdarg.h>
+#include "ruby/re.h"
+#include "ruby/thread.h"
+#include <pthread.h>
 #include "language_ids.h"
+#include "alloc.h"
 
 static VALUE rb_cTree;
 static VALUE rb_cTreeCursor;
 static VALUE rb_cLanguage;
+static VALUE rb_cLazyLanguage;
 static VALUE rb_cTreePath;
+static VALUE rb_cQueryCursor;
+
+/* a single spare cursor that Query#run reuses if no cursor is passed */
+static TSQueryCursor *spare_query_cursor = NULL;
+
+MemoryStats memory_stats;
+
+// not in Ruby's public headers, but exported (ObjectSpace.memsize_of uses it for Regexps)
+size_t onig_memsize(const OnigRegexType *reg);
 
 static ID id_types;
 static ID id_whitespace;
 static ID id_attach;
+static ID id_arena;
 
 ID id_error;
 ID id_invalid;
@@ -29,14 +46,165 @@ ID id___language__;
 #define CLAMP(x, low, high)  (((x) > (high)) ? (high) : (((x) < (low)) ? (low) : (x)))
 #endif
 
+static void
+tree_ancestor_cache_free(TreeAncestorCache *cache)
+{
+  st_free_table(cache->rows);
+  xfree(cache->nodes);
+  xfree(cache->parents);
+  xfree(cache->fields);
+  xfree(cache);
+}
+
 static void
 tree_free(void* obj)
 {
   Tree* tree = (Tree*)obj;
-  ts_tree_delete(tree->ts_tree);
+  if(tree->ancestor_cache != NULL) {
+    tree_ancestor_cache_free(tree->ancestor_cache);
+  }
+  if(tree->ts_tree != NULL) {
+    memory_stats.trees--;
+    memory_stats.tree_bytes -= tree->ts_tree_memsize;
+  }
+  if(tree->arena != NULL) {
+    // subtrees only reference memory in the arena (or in no other tree), so
+    // they don't need to be released one by one
+    tracked_arena_release(tree->arena);
+  } else {
+    ts_tree_delete(tree->ts_tree);
+  }
+  tracked_alloc_sync_gc();
   xfree(obj);
 }
 
+/*
+ * Takes ownership of ts_tree, which holds memsize bytes (measured with
+ * tracked_alloc_thread_bytes around its creation). The runtime allocates outside
+ * the Ruby heap, so the bytes it allocated while parsing are reported to the GC here.
+ */
+static void
+tree_set_ts_tree(Tree *tree, TSTree *ts_tree, size_t memsize)
+{
+  tree->ts_tree = ts_tree;
+  tree->ts_tree_memsize = tree->arena != NULL ? tracked_arena_size(tree->arena) : memsize;
+  memory_stats.trees++;
+  memory_stats.tree_bytes += tree->ts_tree_memsize;
+  tracked_alloc_sync_gc();
+}
+
+static size_t
+tree_memsize(const void *obj)
+{
+  const Tree *tree = (const Tree *)obj;
+  size_t size = sizeof(Tree) + tree->ts_tree_memsize;
+  const TreeAncestorCache *cache = tree->ancestor_cache;
+  if(cache != NULL) {
+    size += sizeof(TreeAncestorCache) + st_memsize(cache->rows) +
+            cache->len * (sizeof(TSNode) + sizeof(int32_t) + sizeof(TSFieldId));
+  }
+  return size;
+}
+
+/*
+ * Returns the tree's ancestor cache, building it on first use.
+ * The cache maps every visible node (by TSNode.id) to a row holding the node,
+ * the row of its parent (-1 for the root) and its field id, all filled in one DFS.
+ */
+TreeAncestorCache *
+tree_ancestor_cache(Tree *tree)
+{
+  if(tree->ancestor_cache != NULL) {
+    return tree->ancestor_cache;
+  }
+
+  TSNode root_node = ts_tree_root_node(tree->ts_tree);
+  uint32_t capa = ts_node_descendant_count(root_node);
+
+  TreeAncestorCache *cache = RB_ZALLOC(TreeAncestorCache);
+  cache->rows = st_init_numtable_with_size(capa);
+  cache->nodes = RB_ALLOC_N(TSNode, capa);
+  cache->parents = RB_ALLOC_N(int32_t, capa);
+  cache->fields = RB_ALLOC_N(TSFieldId, capa);
+
+  uint32_t stack_capa = 32;
+  int32_t *stack = RB_ALLOC_N(int32_t, stack_capa);
+  uint32_t depth = 0;
+  uint32_t max_depth = 0;
+  stack[0] = -1;
+
+  TSTreeCursor cursor = ts_tree_cursor_new(root_node);
+  while(true) {
+    uint32_t row = cache->len++;
+    TSNode ts_node = ts_tree_cursor_current_node(&cursor);
+    cache->nodes[row] = ts_node;
+    cache->parents[row] = stack[depth];
+    cache->fields[row] = ts_tree_cursor_current_field_id(&cursor);
+    st_insert(cache->rows, (st_data_t) ts_node.id, (st_data_t) row);
+
+    if(ts_tree_cursor_goto_first_child(&cursor)) {
+      if(++depth == stack_capa) {
+        stack_capa *= 2;
+        RB_REALLOC_N(stack, int32_t, stack_capa);
+      }
+      stack[depth] = (int32_t) row;
+      max_depth = MAX(max_depth, depth);
+      continue;
+    }
+
+    while(!ts_tree_cursor_goto_next_sibling(&cursor)) {
+      if(!ts_tree_cursor_goto_parent(&cursor)) {
+        goto done;
+      }
+      depth--;
+    }
+  }
+
+done:
+  ts_tree_cursor_delete(&cursor);
+  xfree(stack);
+
+  tree->ancestor_cache = cache;
+  tree->max_path_len = max_depth + 1;
+  return cache;
+}
+
+/*
+ * Returns the number of nodes on the longest path from the root to a leaf,
+ * computing it with one DFS on first use.
+ */
+uint32_t
+tree_max_path_len(Tree *tree)
+{
+  if(tree->max_path_len != 0) {
+    return tree->max_path_len;
+  }
+
+  TSTreeCursor cursor = ts_tree_cursor_new(ts_tree_root_node(tree->ts_tree));
+  uint32_t depth = 0;
+  uint32_t max_depth = 0;
+
+  while(true) {
+    if(ts_tree_cursor_goto_first_child(&cursor)) {
+      depth++;
+      max_depth = MAX(max_depth, depth);
+      continue;
+    }
+
+    while(!ts_tree_cursor_goto_next_sibling(&cursor)) {
+      if(!ts_tree_cursor_goto_parent(&cursor)) {
+        goto done;
+      }
+      depth--;
+    }
+  }
+
+done:
+  ts_tree_cursor_delete(&cursor);
+  tree->max_path_len = max_depth + 1;
+  return tree->max_path_len;
+}
+
 static void
 tree_mark(void* obj)
 {
@@ -49,7 +217,7 @@ const rb_data_type_t tree_type = {
     .function = {
         .dmark = tree_mark,
         .dfree = tree_free,
-        .dsize = NULL,
+        .dsize = tree_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -63,6 +231,13 @@ tree_cursor_free(void* obj)
   xfree(obj);
 }
 
+static size_t
+tree_cursor_memsize(const void *obj)
+{
+  const TreeCursor *tree_cursor = (const TreeCursor *)obj;
+  return sizeof(TreeCursor) + ts_tree_cursor__memsize(&tree_cursor->ts_tree_cursor);
+}
+
 static void
 tree_cursor_mark(void* obj)
 {
@@ -78,7 +253,7 @@ const rb_data_type_t tree_cursor_type = {
     .function = {
         .dmark = tree_cursor_mark,
         .dfree = tree_cursor_free,
-        .dsize = NULL,
+        .dsize = tree_cursor_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -89,6 +264,7 @@ tree_path_free(void* obj)
 {
   TreePath* tree_path = (TreePath*)obj;
   xfree(tree_path->nodes);
+  xfree(tree_path->rb_nodes);
   xfree(obj);
 }
 
@@ -97,6 +273,20 @@ tree_path_mark(void* obj)
 {
   TreePath* tree_path = (TreePath *)obj;
   rb_gc_mark(tree_path->rb_tree);
+  if(tree_path->rb_nodes != NULL) {
+    rb_gc_mark_locations(tree_path->rb_nodes, tree_path->rb_nodes + tree_path->len);
+  }
+}
+
+static size_t
+tree_path_memsize(const void *obj)
+{
+  const TreePath *tree_path = (const TreePath *)obj;
+  size_t size = sizeof(TreePath) + tree_path->len * sizeof(TreePathNode);
+  if(tree_path->rb_nodes != NULL) {
+    size += MAX(tree_path->len, 1) * sizeof(VALUE);
+  }
+  return size;
 }
 
 const rb_data_type_t tree_path_type = {
@@ -104,21 +294,91 @@ const rb_data_type_t tree_path_type = {
     .function = {
         .dmark = tree_path_mark,
         .dfree = tree_path_free,
-        .dsize = NULL,
+        .dsize = tree_path_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
 };
 
 
+static void
+query_predicates_destroy(QueryPredicates *predicates)
+{
+  for(uint32_t i = 0; i < predicates->len; i++) {
+    if(predicates->predicates[i].regex != NULL) {
+      onig_free(predicates->predicates[i].regex);
+    }
+  }
+  xfree(predicates->predicates);
+  xfree(predicates->pattern_offsets);
+  xfree(predicates->string_ids);
+  predicates->predicates = NULL;
+  predicates->pattern_offsets = NULL;
+  predicates->string_ids = NULL;
+  predicates->len = 0;
+}
+
+static void
+query_cache_entry_free(QueryCacheEntry *entry)
+{
+  memory_stats.queries--;
+  memory_stats.query_bytes -= entry->ts_query_memsize;
+  query_predicates_destroy(&entry->predicates);
+  ts_query_delete(entry->ts_query);
+  tracked_alloc_sync_gc();
+  xfree(entry->capture_names);
+  xfree(entry->source);
+  xfree(entry);
+}
+
+static size_t
+query_cache_entry_memsize(const QueryCacheEntry *entry)
+{
+  const QueryPredicates *predicates = &entry->predicates;
+  size_t size = sizeof(QueryCacheEntry) + entry->ts_query_memsize + entry->source_len +
+                ts_query_capture_count(entry->ts_query) * sizeof(ID);
+  if(predicates->predicates != NULL) {
+    size += predicates->len * sizeof(QueryPredicate) +
+            (ts_query_pattern_count(entry->ts_query) + 1) * sizeof(uint32_t);
+  }
+  for(uint32_t i = 0; i < predicates->len; i++) {
+    size += predicates->predicates[i].strings_len * sizeof(uint32_t);
+    if(predicates->predicates[i].regex != NULL) {
+      size += onig_memsize(predicates->predicates[i].regex);
+    }
+  }
+  return size;
+}
+
+static void
+query_cache_entry_release(QueryCacheEntry *entry)
+{
+  entry->refcount--;
+  if(entry->refcount == 0 && !entry->cached) {
+    query_cache_entry_free(entry);
+  }
+}
+
 static void
 query_free(void* obj)
 {
   Query* query = (Query*)obj;
-  ts_query_delete(query->ts_query);
+  query_cache_entry_release(query->cache_entry);
   xfree(obj);
 }
 
+// cached entries are accounted to the language owning the cache
+static size_t
+query_memsize(const void *obj)
+{
+  const Query *query = (const Query *)obj;
+  size_t size = sizeof(Query);
+  if(query->cache_entry != NULL && !query->cache_entry->cached) {
+    size += query_cache_entry_memsize(query->cache_entry);
+  }
+  return size;
+}
+
 static void
 query_mark(void* obj)
 {
@@ -130,7 +390,181 @@ const rb_data_type_t query_type = {
     .function = {
         .dmark = query_mark,
         .dfree = query_free,
-        .dsize = NULL,
+        .dsize = query_memsize,
+    },
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static st_index_t
+query_cache_entry_hash(st_data_t arg) {
+  QueryCacheEntry *entry = (QueryCacheEntry *) arg;
+  return rb_memhash(entry->source, entry->source_len);
+}
+
+static int
+query_cache_entry_cmp(st_data_t x, st_data_t y) {
+  QueryCacheEntry *entry_x = (QueryCacheEntry *) x;
+  QueryCacheEntry *entry_y = (QueryCacheEntry *) y;
+
+  if(entry_x->source_len != entry_y->source_len) return 1;
+  return memcmp(entry_x->source, entry_y->source, entry_x->source_len);
+}
+
+static const struct st_hash_type query_cache_key_hash = {
+    query_cache_entry_cmp,
+    query_cache_entry_hash,
+};
+
+static void
+query_cache_init(QueryCache *query_cache) {
+  query_cache->table = st_init_table(&query_cache_key_hash);
+  query_cache->head = NULL;
+  query_cache->tail = NULL;
+  query_cache->len = 0;
+  query_cache->capa = QUERY_CACHE_DEFAULT_CAPA;
+}
+
+static void
+query_cache_unlink(QueryCache *query_cache, QueryCacheEntry *entry) {
+  if(entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    query_cache->head = entry->next;
+  }
+  if(entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    query_cache->tail = entry->prev;
+  }
+  entry->prev = NULL;
+  entry->next = NULL;
+}
+
+static void
+query_cache_push_front(QueryCache *query_cache, QueryCacheEntry *entry) {
+  entry->prev = NULL;
+  entry->next = query_cache->head;
+  if(query_cache->head) {
+    query_cache->head->prev = entry;
+  } else {
+    query_cache->tail = entry;
+  }
+  query_cache->head = entry;
+}
+
+static void
+query_cache_evict(QueryCache *query_cache, QueryCacheEntry *entry) {
+  st_data_t key = (st_data_t) entry;
+  st_delete(query_cache->table, &key, NULL);
+  query_cache_unlink(query_cache, entry);
+  query_cache->len--;
+  entry->cached = false;
+
+  // entries still used by a query are freed when the last query is freed
+  if(entry->refcount == 0) {
+    query_cache_entry_free(entry);
+  }
+}
+
+static void
+query_cache_shrink(QueryCache *query_cache, size_t len) {
+  while(query_cache->len > len) {
+    query_cache_evict(query_cache, query_cache->tail);
+  }
+}
+
+static void
+query_cache_destroy(QueryCache *query_cache) {
+  query_cache_shrink(query_cache, 0);
+  st_free_table(query_cache->table);
+}
+
+static QueryCacheEntry *
+query_cache_lookup(QueryCache *query_cache, const char *source, size_t source_len) {
+  QueryCacheEntry key_entry = {
+    .source = (char *) source,
+    .source_len = source_len,
+  };
+  st_data_t value;
+  if(st_lookup(query_cache->table, (st_data_t) &key_entry, &value)) {
+    QueryCacheEntry *entry = (QueryCacheEntry *) value;
+    if(query_cache->head != entry) {
+      query_cache_unlink(query_cache, entry);
+      query_cache_push_front(query_cache, entry);
+    }
+    return entry;
+  }
+  return NULL;
+}
+
+/*
+ * Creates an entry for ts_query, taking ownership of it and predicates.
+ * The entry is only added to the cache if cache is true.
+ */
+static QueryCacheEntry *
+query_cache_insert(QueryCache *query_cache, TSQuery *ts_query, QueryPredicates predicates, const char *source, size_t source_len, bool cache) {
+  QueryCacheEntry *entry = RB_ZALLOC(QueryCacheEntry);
+  entry->ts_query = ts_query;
+  entry->ts_query_memsize = ts_query__memsize(ts_query);
+  memory_stats.queries++;
+  memory_stats.query_bytes += entry->ts_query_memsize;
+  tracked_alloc_sync_gc();
+  entry->predicates = predicates;
+  entry->cached = cache && query_cache->capa > 0;
+
+  uint32_t capture_count = ts_query_capture_count(ts_query);
+  entry->capture_names = RB_ALLOC_N(ID, capture_count);
+  for(uint32_t i = 0; i < capture_count; i++) {
+    uint32_t name_len;
+    const char *name = ts_query_capture_name_for_id(ts_query, i, &name_len);
+    entry->capture_names[i] = rb_intern2(name, name_len);
+  }
+
+  if(entry->cached) {
+    entry->source = RB_ALLOC_N(char, source_len);
+    memcpy(entry->source, source, source_len);
+    entry->source_len = source_len;
+  }
+
+  if(entry->cached) {
+    query_cache_shrink(query_cache, query_cache->capa - 1);
+    st_insert(query_cache->table, (st_data_t) entry, (st_data_t) entry);
+    query_cache_push_front(query_cache, entry);
+    query_cache->len++;
+  }
+  return entry;
+}
+
+static void
+query_cursor_free(void* obj)
+{
+  QueryCursor* query_cursor = (QueryCursor*)obj;
+  ts_query_cursor_delete(query_cursor->ts_query_cursor);
+  xfree(obj);
+}
+
+static size_t
+query_cursor_memsize(const void *obj)
+{
+  const QueryCursor *query_cursor = (const QueryCursor *)obj;
+  return sizeof(QueryCursor) + ts_query_cursor__memsize(query_cursor->ts_query_cursor);
+}
+
+static void
+query_cursor_mark(void* obj)
+{
+  QueryCursor* query_cursor = (QueryCursor*)obj;
+  rb_gc_mark(query_cursor->rb_query);
+  rb_gc_mark(query_cursor->rb_tree);
+}
+
+const rb_data_type_t query_cursor_type = {
+    .wrap_struct_name = "TreeSitter::Tree::Query::Cursor",
+    .function = {
+        .dmark = query_cursor_mark,
+        .dfree = query_cursor_free,
+        .dsize = query_cursor_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -140,8 +574,9 @@ static void
 language_free(void* obj)
 {
   Language* language = (Language*)obj;
-  st_free_table(language->ts_symbol_table);
-  st_free_table(language->ts_field_table);
+  query_cache_destroy(&language->query_cache);
+  name_map_free(language->symbol_map);
+  name_map_free(language->field_map);
   xfree(language->ts_symbol2id);
   xfree(language->ts_field2id);
   xfree(obj);
@@ -198,12 +633,26 @@ language_mark(void* obj)
   // rb_gc_mark(language->rb_input);
 }*/
 
+static size_t
+language_memsize(const void *obj)
+{
+  const Language *language = (const Language *)obj;
+  size_t size = sizeof(Language) +
+                name_map_memsize(language->symbol_map) + name_map_memsize(language->field_map) +
+                (language->symbol_count + language->field_count) * sizeof(ID) +
+                st_memsize(language->query_cache.table);
+  for(const QueryCacheEntry *entry = language->query_cache.head; entry != NULL; entry = entry->next) {
+    size += query_cache_entry_memsize(entry);
+  }
+  return size;
+}
+
 const rb_data_type_t language_type = {
     .wrap_struct_name = "Language",
     .function = {
         .dmark = NULL /*language_mark*/,
         .dfree = language_free,
-        .dsize = NULL,
+        .dsize = language_memsize,
     },
     .data = NULL,
     .flags = RUBY_TYPED_FREE_IMMEDIATELY,
@@ -218,35 +667,79 @@ rb_new_language(TSLanguage *ts_language, LanguageId language_id)
   uint32_t symbol_count = ts_language_symbol_count(ts_language);
   uint32_t field_count = ts_language_field_count(ts_language);
 
-  language->ts_symbol_table = st_init_numtable();
-  language->ts_field_table = st_init_numtable();
-
   language->ts_symbol2id = RB_ZALLOC_N(ID, symbol_count);
+  /* NOTE: field ids start at 1, so there are field_count + 1 slots */
   language->ts_field2id = RB_ZALLOC_N(ID, field_count + 1);
   language->symbol_count = symbol_count;
   language->field_count = field_count + 1;
   language->id = (LanguageId) language_id;
+  query_cache_init(&language->query_cache);
 
-  for(uint32_t i = 0; i < symbol_count; i++) {
-    const char *symbol_name = ts_language_symbol_name(ts_language, (TSSymbol) i);
-    if(symbol_name != NULL) {
-      ID symbol_id = rb_intern(symbol_name);
-      st_insert(language->ts_symbol_table, (st_data_t) symbol_id, i);
-      language->ts_symbol2id[i] = symbol_id;
-    }
-  }
+  return TypedData_Wrap_Struct(rb_cLanguage, &language_type, language);
+}
+
+typedef struct {
+  const TSLanguage *(*ts_language)(void);
+  LanguageId id;
+  VALUE rb_klass;
+  VALUE rb_query_klass;
+} LazyLanguage;
+
+static void
+lazy_language_mark(void *obj)
+{
+  LazyLanguage *lazy = (LazyLanguage *)obj;
+  rb_gc_mark(lazy->rb_klass);
+  rb_gc_mark(lazy->rb_query_klass);
+}
 
-  /* NOTE: for some reason it's <= field_count */
-  for(uint32_t i = 0; i <= field_count; i++) {
-    const char *field_name = ts_language_field_name_for_id(ts_language, (TSFieldId) i);
-    if(field_name != NULL) {
-      ID field_id = rb_intern(field_name);
-      st_insert(language->ts_field_table, (st_data_t) field_id, i);
-      language->ts_field2id[i] = field_id;
-    }  
+static const rb_data_type_t lazy_language_type = {
+    .wrap_struct_name = "LazyLanguage",
+    .function = {
+        .dmark = lazy_language_mark,
+        .dfree = RUBY_TYPED_DEFAULT_FREE,
+        .dsize = NULL,
+    },
+    .data = NULL,
+    .flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/*
+ * Registers rb_klass and its query class as a language whose {Language}
+ * is only built on first use. Interning a grammar's symbols is most of the
+ * cost of loading it, so bundles of many grammars defer it.
+ */
+void
+rb_define_lazy_language(VALUE rb_klass, VALUE rb_query_klass, const TSLanguage *(*ts_language)(void), LanguageId id)
+{
+  LazyLanguage *lazy;
+  VALUE rb_lazy = TypedData_Make_Struct(rb_cLazyLanguage, LazyLanguage, &lazy_language_type, lazy);
+  lazy->ts_language = ts_language;
+  lazy->id = id;
+  lazy->rb_klass = rb_klass;
+  lazy->rb_query_klass = rb_query_klass;
+
+  rb_ivar_set(rb_klass, id___language__, rb_lazy);
+  rb_ivar_set(rb_query_klass, id___language__, rb_lazy);
+}
+
+/*
+ * Returns the {Language} of a language (or language query) class, building
+ * it if it was registered with rb_define_lazy_language, or nil.
+ */
+VALUE
+rb_language_of(VALUE rb_klass)
+{
+  VALUE rb_language = rb_ivar_get(rb_klass, id___language__);
+  if(!rb_typeddata_is_kind_of(rb_language, &lazy_language_type)) {
+    return rb_language;
   }
 
-  return TypedData_Wrap_Struct(rb_cLanguage, &language_type, language);
+  LazyLanguage *lazy = RTYPEDDATA_DATA(rb_language);
+  rb_language = rb_new_language((TSLanguage *) lazy->ts_language(), lazy->id);
+  rb_ivar_set(lazy->rb_klass, id___language__, rb_language);
+  rb_ivar_set(lazy->rb_query_klass, id___language__, rb_language);
+  return rb_language;
 }
 
 static VALUE
@@ -255,8 +748,8 @@ rb_language_fields(VALUE self) {
   TypedData_Get_Struct(self, Language, &language_type, language);
 
   VALUE rb_fields = rb_ary_new_capa(language->field_count);
-  for(size_t i = 0; i < language->field_count; i++) {
-    ID id = language->ts_field2id[i];
+  for(size_t i = 1; i < language->field_count; i++) {
+    ID id = language_field2id(language, (TSFieldId) i);
     if(id) {
       rb_ary_push(rb_fields, RB_ID2SYM(id));
     }
@@ -272,151 +765,1218 @@ rb_language_symbols(VALUE self) {
 
   VALUE rb_symbols = rb_ary_new_capa(language->symbol_count);
   for(size_t i = 0; i < language->symbol_count; i++) {
-    rb_ary_push(rb_symbols, RB_ID2SYM(language->ts_symbol2id[i]));
+    rb_ary_push(rb_symbols, RB_ID2SYM(language_symbol2id(language, (TSSymbol) i)));
   }
   return rb_symbols;
 }
 
-bool language_id2field(Language *language, ID id, TSFieldId *field_id) {
-  st_data_t ts_field_id;
-  if(st_lookup(language->ts_field_table, (st_data_t) id, &ts_field_id)) {
-    *field_id = (TSFieldId) ts_field_id;
-    return true;
-  }
-  return false;
+/*
+ * Public: Bytes currently allocated by the runtime for this language's parses,
+ * trees and compiled queries.
+ *
+ * Returns an {Integer}.
+ */
+static VALUE
+rb_language_live_bytes(VALUE self) {
+  Language *language;
+  TypedData_Get_Struct(self, Language, &language_type, language);
+  return SIZET2NUM(tracked_alloc_language_live_bytes(language->id));
 }
 
-bool language_id2symbol(Language *language, ID id, TSSymbol *symbol) {
-  st_data_t ts_symbol;
-  if(st_lookup(language->ts_symbol_table, (st_data_t) id, &ts_symbol)) {
-    *symbol = (TSSymbol) ts_symbol;
-    return true;
-  }
-  return false;
+static VALUE
+rb_language_query_cache_capacity(VALUE self) {
+  Language* language;
+  TypedData_Get_Struct(self, Language, &language_type, language);
+
+  return SIZET2NUM(language->query_cache.capa);
 }
 
 static VALUE
-rb_query_new(VALUE self, VALUE rb_source) {
-  Check_Type(rb_source, T_STRING);
+rb_language_set_query_cache_capacity(VALUE self, VALUE rb_capa) {
+  Language* language;
+  TypedData_Get_Struct(self, Language, &language_type, language);
 
-  char *source = RSTRING_PTR(rb_source);
-  size_t length = RSTRING_LEN(rb_source);
+  size_t capa = NUM2SIZET(rb_capa);
+  query_cache_shrink(&language->query_cache, capa);
+  language->query_cache.capa = capa;
+  return rb_capa;
+}
 
-  uint32_t error_offset;
-  TSQueryError error_type;
+static VALUE
+rb_language_query_cache_size(VALUE self) {
+  Language* language;
+  TypedData_Get_Struct(self, Language, &language_type, language);
+
+  return SIZET2NUM(language->query_cache.len);
+}
 
-  VALUE rb_language = rb_ivar_get(self, id___language__);
+static VALUE
+rb_language_clear_query_cache(VALUE self) {
   Language* language;
-  TypedData_Get_Struct(rb_language, Language, &language_type, language);
+  TypedData_Get_Struct(self, Language, &language_type, language);
 
-  TSQuery *ts_query = ts_query_new(language->ts_language, source, length, &error_offset, &error_type);
-  if(!ts_query) {
-        // Adapted from https://github.com/tree-sitter/py-tree-sitter/blob/master/tree_sitter/binding.c
-        // The MIT License (MIT)
-        // Original version Copyright (c) 2019 Max Brunsfeld, GitHub
-        char *word_start = &source[error_offset];
-        char *word_end = word_start;
-        while (word_end < &source[length] &&
-               (iswalnum(*word_end) || *word_end == '-' || *word_end == '_' || *word_end == '?' ||
-                *word_end == '.'))
-            word_end++;
-        char c = *word_end;
-        *word_end = 0;
-        switch (error_type) {
-        case TSQueryErrorNodeType:
-            rb_raise(rb_eArgError, "Invalid node type %s", &source[error_offset]);
-            break;
-        case TSQueryErrorField:
-            rb_raise(rb_eArgError, "Invalid field name %s", &source[error_offset]);
-            break;
-        case TSQueryErrorCapture:
-            rb_raise(rb_eArgError, "Invalid capture name %s", &source[error_offset]);
-            break;
-        default:
-            rb_raise(rb_eArgError, "Invalid syntax at offset %u", error_offset);
-            break;
-        }
-        *word_end = c;
-        return Qnil;
+  query_cache_shrink(&language->query_cache, 0);
+  return self;
+}
+
+ID
+language_intern_symbol(Language *language, TSSymbol symbol)
+{
+  const char *name = ts_language_symbol_name(language->ts_language, symbol);
+  if(name == NULL) {
+    return 0;
+  }
+  return language->ts_symbol2id[symbol] = rb_intern(name);
+}
+
+ID
+language_intern_field(Language *language, TSFieldId field_id)
+{
+  const char *name = ts_language_field_name_for_id(language->ts_language, field_id);
+  if(name == NULL) {
+    return 0;
+  }
+  return language->ts_field2id[field_id] = rb_intern(name);
+}
+
+static inline bool
+language_name_map_lookup(NameMap **map, Language *language, NameMapName name, uint32_t count, ID id, uint16_t *value)
+{
+  if(RB_UNLIKELY(*map == NULL)) {
+    *map = name_map_new(language->ts_language, name, count);
+  }
+  return name_map_lookup_id(*map, id, value);
+}
+
+bool language_id2field(Language *language, ID id, TSFieldId *field_id) {
+  return language_name_map_lookup(&language->field_map, language, ts_language_field_name_for_id,
+                                  (uint32_t) language->field_count, id, field_id);
+}
+
+bool language_id2symbol(Language *language, ID id, TSSymbol *symbol) {
+  return language_name_map_lookup(&language->symbol_map, language, ts_language_symbol_name,
+                                  (uint32_t) language->symbol_count, id, symbol);
+}
+
+__attribute__((format(printf, 3, 4))) static void
+query_predicates_raise(QueryPredicates *predicates, TSQuery *ts_query, const char *fmt, ...) {
+  char message[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(message, sizeof(message), fmt, args);
+  va_end(args);
+
+  query_predicates_destroy(predicates);
+  ts_query_delete(ts_query);
+  rb_raise(rb_eArgError, "%s", message);
+}
+
+static bool
+query_predicate_parse_name(const char *name, QueryPredicate *predicate) {
+  predicate->any = false;
+  predicate->negated = false;
+
+  if(!strncmp(name, "any-", 4) && strcmp(name, "any-of?")) {
+    predicate->any = true;
+    name += 4;
+  }
+
+  if(!strncmp(name, "not-", 4)) {
+    predicate->negated = true;
+    name += 4;
+  }
+
+  if(!strcmp(name, "eq?")) {
+    predicate->type = QUERY_PREDICATE_EQ;
+  } else if(!strcmp(name, "match?")) {
+    predicate->type = QUERY_PREDICATE_MATCH;
+  } else if(!strcmp(name, "any-of?") && !predicate->any) {
+    predicate->type = QUERY_PREDICATE_ANY_OF;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Compiles the #eq?, #match? and #any-of? predicates (and their not-/any- variants) of all patterns.
+ * Other predicates are ignored and left for the caller to evaluate.
+ * Raises (and deletes ts_query) if a predicate is malformed.
+ */
+static QueryPredicates
+query_predicates_compile(TSQuery *ts_query) {
+  uint32_t pattern_count = ts_query_pattern_count(ts_query);
+  QueryPredicates predicates = {
+    .predicates = NULL,
+    .pattern_offsets = NULL,
+    .string_ids = NULL,
+    .len = 0,
+  };
+
+  uint32_t max_predicates = 0;
+  uint32_t max_strings = 0;
+  for(uint32_t i = 0; i < pattern_count; i++) {
+    uint32_t step_count;
+    const TSQueryPredicateStep *steps = ts_query_predicates_for_pattern(ts_query, i, &step_count);
+    for(uint32_t j = 0; j < step_count; j++) {
+      if(steps[j].type == TSQueryPredicateStepTypeDone) {
+        max_predicates++;
+      } else if(steps[j].type == TSQueryPredicateStepTypeString) {
+        max_strings++;
+      }
+    }
+  }
+
+  if(max_predicates == 0) {
+    return predicates;
+  }
+
+  predicates.predicates = RB_ZALLOC_N(QueryPredicate, max_predicates);
+  predicates.pattern_offsets = RB_ZALLOC_N(uint32_t, pattern_count + 1);
+  predicates.string_ids = RB_ZALLOC_N(uint32_t, max_strings);
+  uint32_t strings_len = 0;
+
+  for(uint32_t i = 0; i < pattern_count; i++) {
+    uint32_t step_count;
+    const TSQueryPredicateStep *steps = ts_query_predicates_for_pattern(ts_query, i, &step_count);
+    predicates.pattern_offsets[i] = predicates.len;
+
+    uint32_t start = 0;
+    while(start < step_count) {
+      uint32_t end = start;
+      while(steps[end].type != TSQueryPredicateStepTypeDone) end++;
+
+      uint32_t name_len;
+      const char *name = ts_query_string_value_for_id(ts_query, steps[start].value_id, &name_len);
+      uint32_t argc = end - start - 1;
+      const TSQueryPredicateStep *args = &steps[start + 1];
+      QueryPredicate *predicate = &predicates.predicates[predicates.len];
+
+      if(steps[start].type != TSQueryPredicateStepTypeString || !query_predicate_parse_name(name, predicate)) {
+        start = end + 1;
+        continue;
+      }
+
+      if(argc < 2 || (predicate->type != QUERY_PREDICATE_ANY_OF && argc != 2)) {
+        query_predicates_raise(&predicates, ts_query, "wrong number of arguments to #%s (pattern %u)", name, i);
+      }
+
+      if(args[0].type != TSQueryPredicateStepTypeCapture) {
+        query_predicates_raise(&predicates, ts_query, "first argument to #%s must be a capture (pattern %u)", name, i);
+      }
+      predicate->capture_id = args[0].value_id;
+      predicate->strings_start = strings_len;
+
+      for(uint32_t k = 1; k < argc; k++) {
+        if(args[k].type == TSQueryPredicateStepTypeCapture) {
+          if(predicate->type != QUERY_PREDICATE_EQ) {
+            query_predicates_raise(&predicates, ts_query, "arguments to #%s must be strings (pattern %u)", name, i);
+          }
+          predicate->capture_arg = true;
+          predicate->arg_capture_id = args[k].value_id;
+        } else {
+          predicates.string_ids[strings_len++] = args[k].value_id;
+        }
+      }
+      predicate->strings_len = strings_len - predicate->strings_start;
+
+      // count it before compiling the regex, so it is freed on errors
+      predicates.len++;
+
+      if(predicate->type == QUERY_PREDICATE_MATCH) {
+        uint32_t pattern_len;
+        const char *pattern = ts_query_string_value_for_id(ts_query, args[1].value_id, &pattern_len);
+        OnigErrorInfo error_info;
+        int ret = onig_new(&predicate->regex, (const OnigUChar *) pattern, (const OnigUChar *) pattern + pattern_len,
+                           ONIG_OPTION_NONE, rb_utf8_encoding(), ONIG_SYNTAX_RUBY, &error_info);
+        if(ret != ONIG_NORMAL) {
+          OnigUChar error_message[ONIG_MAX_ERROR_MESSAGE_LEN];
+          predicate->regex = NULL;
+          onig_error_code_to_str(error_message, ret, &error_info);
+          query_predicates_raise(&predicates, ts_query, "invalid regex in #%s (pattern %u): %s", name, i, error_message);
+        }
+      }
+
+      start = end + 1;
+    }
+
+    // the predicates are evaluated on complete matches, even in capture order
+    if(predicates.len > predicates.pattern_offsets[i]) {
+      ts_query__hold_pattern_captures(ts_query, i);
+    }
+  }
+  predicates.pattern_offsets[pattern_count] = predicates.len;
+
+  return predicates;
+}
+
+static bool
+query_predicate_test_node(const QueryPredicate *predicate, const QueryPredicates *predicates, const TSQuery *ts_query,
+                          const TSQueryMatch *match, TSNode node, const char *input, size_t input_len) {
+  uint32_t start_byte = ts_node_start_byte(node);
+  uint32_t end_byte = ts_node_end_byte(node);
+  if(end_byte > input_len) {
+    return false;
+  }
+
+  const char *text = input + start_byte;
+  uint32_t text_len = end_byte - start_byte;
+
+  switch(predicate->type) {
+    case QUERY_PREDICATE_EQ: {
+      if(predicate->capture_arg) {
+        for(uint16_t i = 0; i < match->capture_count; i++) {
+          if(match->captures[i].index == predicate->arg_capture_id) {
+            TSNode other = match->captures[i].node;
+            uint32_t other_start_byte = ts_node_start_byte(other);
+            uint32_t other_end_byte = ts_node_end_byte(other);
+            if(other_end_byte > input_len) return false;
+            return other_end_byte - other_start_byte == text_len &&
+                   !memcmp(input + other_start_byte, text, text_len);
+          }
+        }
+        // an absent capture equals nothing, so only the not-eq? form passes
+        return false;
+      }
+      uint32_t value_len;
+      const char *value = ts_query_string_value_for_id(ts_query, predicates->string_ids[predicate->strings_start], &value_len);
+      return value_len == text_len && !memcmp(value, text, text_len);
+    }
+    case QUERY_PREDICATE_MATCH: {
+      const OnigUChar *str = (const OnigUChar *) text;
+      return onig_search(predicate->regex, str, str + text_len, str, str + text_len, NULL, ONIG_OPTION_NONE) >= 0;
+    }
+    case QUERY_PREDICATE_ANY_OF: {
+      for(uint32_t i = 0; i < predicate->strings_len; i++) {
+        uint32_t value_len;
+        const char *value = ts_query_string_value_for_id(ts_query, predicates->string_ids[predicate->strings_start + i], &value_len);
+        if(value_len == text_len && !memcmp(value, text, text_len)) return true;
+      }
+      return false;
+    }
+  }
+  return true;
+}
+
+/*
+ * Checks the compiled predicates of match's pattern.
+ * Captures that are not part of the match satisfy any predicate. A capture
+ * compared against one that is not part of the match is not equal to it.
+ */
+static bool
+query_predicates_satisfied(const QueryPredicates *predicates, const TSQuery *ts_query, const TSQueryMatch *match,
+                           const char *input, size_t input_len) {
+  if(predicates->len == 0) {
+    return true;
+  }
+
+  uint32_t start = predicates->pattern_offsets[match->pattern_index];
+  uint32_t end = predicates->pattern_offsets[match->pattern_index + 1];
+
+  for(uint32_t i = start; i < end; i++) {
+    const QueryPredicate *predicate = &predicates->predicates[i];
+    bool any_passed = false;
+    bool all_passed = true;
+    bool found = false;
+
+    for(uint16_t j = 0; j < match->capture_count; j++) {
+      if(match->captures[j].index != predicate->capture_id) continue;
+      found = true;
+      bool passed = query_predicate_test_node(predicate, predicates, ts_query, match, match->captures[j].node, input, input_len) != predicate->negated;
+      any_passed |= passed;
+      all_passed &= passed;
+    }
+
+    if(found && !(predicate->any ? any_passed : all_passed)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static VALUE
+rb_query_new(VALUE self, VALUE rb_source, VALUE rb_cache) {
+  Check_Type(rb_source, T_STRING);
+
+  char *source = RSTRING_PTR(rb_source);
+  size_t length = RSTRING_LEN(rb_source);
+
+  uint32_t error_offset;
+  TSQueryError error_type;
+
+  VALUE rb_language = rb_language_of(self);
+  Language* language;
+  TypedData_Get_Struct(rb_language, Language, &language_type, language);
+
+  bool cache = RTEST(rb_cache);
+
+  if(cache) {
+    QueryCacheEntry *cache_entry = query_cache_lookup(&language->query_cache, source, length);
+    if(cache_entry != NULL) {
+      Query *query = RB_ZALLOC(Query);
+      query->language = language;
+      query->ts_query = cache_entry->ts_query;
+      query->cache_entry = cache_entry;
+      cache_entry->refcount++;
+      return TypedData_Wrap_Struct(self, &query_type, query);
+    }
+  }
+
+  int previous_tag = tracked_alloc_tag(language->id);
+  TSQuery *ts_query = ts_query_new(language->ts_language, source, length, &error_offset, &error_type);
+  tracked_alloc_tag(previous_tag);
+  if(!ts_query) {
+        // Adapted from https://github.com/tree-sitter/py-tree-sitter/blob/master/tree_sitter/binding.c
+        // The MIT License (MIT)
+        // Original version Copyright (c) 2019 Max Brunsfeld, GitHub
+        char *word_start = &source[error_offset];
+        char *word_end = word_start;
+        while (word_end < &source[length] &&
+               (iswalnum(*word_end) || *word_end == '-' || *word_end == '_' || *word_end == '?' ||
+                *word_end == '.'))
+            word_end++;
+        char c = *word_end;
+        *word_end = 0;
+        switch (error_type) {
+        case TSQueryErrorNodeType:
+            rb_raise(rb_eArgError, "Invalid node type %s", &source[error_offset]);
+            break;
+        case TSQueryErrorField:
+            rb_raise(rb_eArgError, "Invalid field name %s", &source[error_offset]);
+            break;
+        case TSQueryErrorCapture:
+            rb_raise(rb_eArgError, "Invalid capture name %s", &source[error_offset]);
+            break;
+        default:
+            rb_raise(rb_eArgError, "Invalid syntax at offset %u", error_offset);
+            break;
+        }
+        *word_end = c;
+        return Qnil;
+  }
+
+  QueryPredicates predicates = query_predicates_compile(ts_query);
+
+  Query *query = RB_ZALLOC(Query);
+
+  query->language = language;
+  query->ts_query = ts_query;
+  query->cache_entry = query_cache_insert(&language->query_cache, ts_query, predicates, source, length, cache);
+  query->cache_entry->refcount++;
+
+  return TypedData_Wrap_Struct(self, &query_type, query);
+}
+
+typedef enum {
+  QUERY_RUN_MODE_RUN,
+  QUERY_RUN_MODE_MATCHES,
+  QUERY_RUN_MODE_CAPTURES,
+} QueryRunMode;
+
+typedef struct {
+  TSQueryCursor *cursor;
+  VALUE rb_tree;
+  QueryCursor *query_cursor;
+  Query *query;
+  QueryRunMode mode;
+  VALUE rb_packed;
+  bool profile;
+  uint64_t *pattern_state_counts;
+  QueryPatternStats *pattern_stats;
+  // the pattern the last match was charged to
+  QueryPatternStats *last_stats;
+  // match ids are handed out in order when a match is first returned,
+  // so ids from this one on belong to matches not seen yet
+  uint32_t next_match_id;
+  VALUE rb_stats;
+  bool exceeded_match_limit;
+} QueryRunArgs;
+
+static uint64_t
+query_profile_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+static VALUE
+query_profile_to_rb(QueryRunArgs *args) {
+  uint32_t pattern_count = ts_query_pattern_count(args->query->ts_query);
+  VALUE rb_stats = rb_hash_new();
+  for(uint32_t i = 0; i < pattern_count; i++) {
+    QueryPatternStats *stats = &args->pattern_stats[i];
+    VALUE rb_pattern_stats = rb_hash_new();
+    rb_hash_aset(rb_pattern_stats, ID2SYM(rb_intern("states")), ULL2NUM(args->pattern_state_counts[i]));
+    rb_hash_aset(rb_pattern_stats, ID2SYM(rb_intern("matches")), ULL2NUM(stats->matches));
+    rb_hash_aset(rb_pattern_stats, ID2SYM(rb_intern("rejected")), ULL2NUM(stats->rejected));
+    rb_hash_aset(rb_pattern_stats, ID2SYM(rb_intern("ns")), ULL2NUM(stats->ns));
+    rb_hash_aset(rb_stats, UINT2NUM(i), rb_pattern_stats);
+  }
+  return rb_stats;
+}
+
+static bool
+query_run_next(QueryRunArgs *args, Tree *tree, TSQueryMatch *match, uint32_t *capture_index) {
+  const QueryPredicates *predicates = &args->query->cache_entry->predicates;
+  uint64_t start_ns = args->profile ? query_profile_clock() : 0;
+
+  while(true) {
+    bool found;
+    if(args->mode == QUERY_RUN_MODE_MATCHES) {
+      found = ts_query_cursor_next_match(args->cursor, match);
+    } else {
+      found = ts_query_cursor_next_capture(args->cursor, match, capture_index);
+    }
+
+    if(!found) {
+      // the final advance, which finds nothing, goes to the last pattern that matched
+      if(args->last_stats != NULL) {
+        args->last_stats->ns += query_profile_clock() - start_ns;
+      }
+      return false;
+    }
+
+    // captures of a match are returned one at a time, only the first counts the match.
+    // That is not always capture 0: captures before the cursor's range are skipped.
+    bool first = args->mode == QUERY_RUN_MODE_MATCHES || match->id >= args->next_match_id;
+    if(first) {
+      args->next_match_id = match->id + 1;
+    }
+
+    // the cursor advances until some pattern produces a match,
+    // so the time is attributed to that pattern
+    QueryPatternStats *stats = args->profile ? &args->pattern_stats[match->pattern_index] : NULL;
+
+    // Predicates are checked once per match, when it is first returned. Matches of
+    // patterns with predicates are only returned once finished (see
+    // query_predicates_compile); later captures were accepted with the match, as
+    // rejected matches are removed below.
+    bool satisfied = true;
+    if(first && predicates->len > 0) {
+      // the block might have replaced or detached the input
+      if(NIL_P(tree->rb_input)) {
+        rb_raise(rb_eTreeSitterError, "no input attached (needed for query predicates)");
+      }
+      const char *input = RSTRING_PTR(tree->rb_input);
+      size_t input_len = RSTRING_LEN(tree->rb_input);
+      satisfied = query_predicates_satisfied(predicates, args->query->ts_query, match, input, input_len);
+    }
+
+    if(stats != NULL) {
+      if(first) {
+        if(satisfied) {
+          stats->matches++;
+        } else {
+          stats->rejected++;
+        }
+      }
+      uint64_t now_ns = query_profile_clock();
+      stats->ns += now_ns - start_ns;
+      start_ns = now_ns;
+      args->last_stats = stats;
+    }
+    if(satisfied) {
+      return true;
+    }
+    ts_query_cursor_remove_match(args->cursor, match->id);
+  }
+}
+
+static void
+query_run_pack_capture(VALUE rb_buf, const TSQueryMatch *match, const TSQueryCapture *capture) {
+  uint32_t tuple[5] = {
+    match->id,
+    match->pattern_index,
+    capture->index,
+    ts_node_start_byte(capture->node),
+    ts_node_end_byte(capture->node),
+  };
+  rb_str_cat(rb_buf, (const char *) tuple, sizeof(tuple));
+}
+
+static VALUE
+rb_query_run_yield(VALUE args_) {
+  QueryRunArgs *args = (QueryRunArgs *) args_;
+  const QueryPredicates *predicates = &args->query->cache_entry->predicates;
+  const ID *capture_names = args->query->cache_entry->capture_names;
+  bool packed = !NIL_P(args->rb_packed);
+  Tree *tree = rb_tree_unwrap(args->rb_tree);
+  uint32_t capture_index = 0;
+  TSQueryMatch match;
+
+  if(predicates->len > 0 && NIL_P(tree->rb_input)) {
+    rb_raise(rb_eTreeSitterError, "no input attached (needed for query predicates)");
+  }
+
+  while (query_run_next(args, tree, &match, &capture_index)) {
+    switch(args->mode) {
+      case QUERY_RUN_MODE_RUN: {
+        VALUE rb_captures = rb_ary_new_capa(match.capture_count);
+        for(uint32_t i = 0; i < match.capture_count; i++) {
+          rb_ary_push(rb_captures, rb_new_node(args->rb_tree, match.captures[i].node));
+        }
+        rb_yield_values(2, rb_captures, UINT2NUM(match.pattern_index));
+        break;
+      }
+      case QUERY_RUN_MODE_MATCHES: {
+        if(packed) {
+          for(uint32_t i = 0; i < match.capture_count; i++) {
+            query_run_pack_capture(args->rb_packed, &match, &match.captures[i]);
+          }
+        } else {
+          VALUE rb_captures = rb_ary_new_capa(match.capture_count);
+          VALUE rb_capture_names = rb_ary_new_capa(match.capture_count);
+          for(uint32_t i = 0; i < match.capture_count; i++) {
+            rb_ary_push(rb_captures, rb_new_node(args->rb_tree, match.captures[i].node));
+            rb_ary_push(rb_capture_names, RB_ID2SYM(capture_names[match.captures[i].index]));
+          }
+          rb_yield_values(3, rb_captures, rb_capture_names, UINT2NUM(match.pattern_index));
+        }
+        break;
+      }
+      case QUERY_RUN_MODE_CAPTURES: {
+        const TSQueryCapture *capture = &match.captures[capture_index];
+        if(packed) {
+          query_run_pack_capture(args->rb_packed, &match, capture);
+        } else {
+          rb_yield_values(3, rb_new_node(args->rb_tree, capture->node),
+                          RB_ID2SYM(capture_names[capture->index]), UINT2NUM(match.pattern_index));
+        }
+        break;
+      }
+    }
+  }
+
+  args->exceeded_match_limit = ts_query_cursor_did_exceed_match_limit(args->cursor);
+  if(args->profile) {
+    args->rb_stats = query_profile_to_rb(args);
+  }
+  return Qnil;
+}
+
+static VALUE
+rb_query_run_ensure(VALUE args_) {
+  QueryRunArgs *args = (QueryRunArgs *) args_;
+  if(args->profile) {
+    ts_query_cursor__set_pattern_state_counts(args->cursor, NULL);
+    xfree(args->pattern_state_counts);
+    xfree(args->pattern_stats);
+  }
+  if(args->query_cursor != NULL) {
+    ts_query_cursor_set_match_limit(args->cursor, args->query_cursor->match_limit);
+    ts_query_cursor_set_max_start_depth(args->cursor, args->query_cursor->max_start_depth);
+    args->query_cursor->running = false;
+    args->query_cursor->rb_query = Qnil;
+    args->query_cursor->rb_tree = Qnil;
+  } else if(spare_query_cursor == NULL) {
+    spare_query_cursor = args->cursor;
+  } else {
+    ts_query_cursor_delete(args->cursor);
+  }
+  return Qnil;
+}
+
+static QueryCursor *
+query_cursor_acquire(VALUE rb_query_cursor) {
+  QueryCursor* query_cursor;
+  TypedData_Get_Struct(rb_query_cursor, QueryCursor, &query_cursor_type, query_cursor);
+
+  if(query_cursor->running) {
+    rb_raise(rb_eTreeSitterError, "query cursor is already running");
+  }
+  return query_cursor;
+}
+
+// Returns the packed buffer or profile if requested, otherwise whether the
+// match limit was exceeded.
+static VALUE
+query_run_exec(QueryRunArgs *run_args) {
+  if(run_args->profile) {
+    uint32_t pattern_count = ts_query_pattern_count(run_args->query->ts_query);
+    run_args->pattern_state_counts = RB_ZALLOC_N(uint64_t, pattern_count);
+    run_args->pattern_stats = RB_ZALLOC_N(QueryPatternStats, pattern_count);
+    run_args->last_stats = NULL;
+    run_args->rb_stats = Qnil;
+    ts_query_cursor__set_pattern_state_counts(run_args->cursor, run_args->pattern_state_counts);
+  }
+
+  rb_ensure(rb_query_run_yield, (VALUE) run_args, rb_query_run_ensure, (VALUE) run_args);
+
+  if(run_args->profile) {
+    return run_args->rb_stats;
+  }
+  if(!NIL_P(run_args->rb_packed)) {
+    return run_args->rb_packed;
+  }
+  return run_args->exceeded_match_limit ? Qtrue : Qfalse;
+}
+
+// Per-call limits, falling back to the given ones where nil.
+static void
+query_cursor_set_limits(TSQueryCursor *cursor, VALUE rb_match_limit, VALUE rb_max_start_depth,
+                        uint32_t match_limit, uint32_t max_start_depth) {
+  // both are converted before either is set, so a bad one leaves the cursor as it was
+  if(!NIL_P(rb_match_limit)) {
+    match_limit = NUM2UINT(rb_match_limit);
+  }
+  if(!NIL_P(rb_max_start_depth)) {
+    max_start_depth = NUM2UINT(rb_max_start_depth);
+  }
+  ts_query_cursor_set_match_limit(cursor, match_limit);
+  ts_query_cursor_set_max_start_depth(cursor, max_start_depth);
+}
+
+static VALUE
+rb_query_cursor_run(QueryCursor *query_cursor, VALUE rb_query, VALUE rb_node, QueryRunMode mode, VALUE rb_packed, bool profile) {
+  Query* query;
+  TypedData_Get_Struct(rb_query, Query, &query_type, query);
+
+  AstNode* node;
+  TypedData_Get_Struct(rb_node, AstNode, &node_type, node);
+
+  query_cursor->running = true;
+  query_cursor->rb_query = rb_query;
+  query_cursor->rb_tree = node->rb_tree;
+
+  ts_query_cursor__trim_capture_lists(query_cursor->ts_query_cursor);
+  ts_query_cursor_exec(query_cursor->ts_query_cursor, query->ts_query, node->ts_node);
+
+  QueryRunArgs run_args = {
+    .cursor = query_cursor->ts_query_cursor,
+    .rb_tree = node->rb_tree,
+    .query_cursor = query_cursor,
+    .query = query,
+    .mode = mode,
+    .rb_packed = rb_packed,
+    .profile = profile,
+  };
+
+  return query_run_exec(&run_args);
+}
+
+static VALUE
+query_run(VALUE self, VALUE rb_node, VALUE rb_start_byte, VALUE rb_end_byte, VALUE rb_start_point, VALUE rb_end_point, VALUE rb_cursor,
+          VALUE rb_match_limit, VALUE rb_max_start_depth, QueryRunMode mode, VALUE rb_packed, bool profile) {
+
+  Query* query;
+  TypedData_Get_Struct(self, Query, &query_type, query);
+
+  TSPoint start_point = {.row = 0, .column = 0};
+  TSPoint end_point = {.row = UINT32_MAX, .column = UINT32_MAX};
+  unsigned start_byte = 0, end_byte = UINT32_MAX;
+
+  if(RTEST(rb_start_byte)) {
+    start_byte = FIX2UINT(rb_start_byte);
+  }
+
+  if(RTEST(rb_end_byte)) {
+    end_byte = FIX2UINT(rb_end_byte);
+  }
+
+  if(RTEST(rb_start_point)) {
+    start_point = rb_point_point_(rb_start_point);
+  }
+
+  if(RTEST(rb_end_point)) {
+    end_point = rb_point_point_(rb_end_point);
+  }
+
+  AstNode* node;
+  TypedData_Get_Struct(rb_node, AstNode, &node_type, node);
+
+  if(!NIL_P(rb_cursor)) {
+    QueryCursor *query_cursor = query_cursor_acquire(rb_cursor);
+    // without range arguments, the range set on the cursor applies
+    if(RTEST(rb_start_byte) || RTEST(rb_end_byte)) {
+      ts_query_cursor_set_byte_range(query_cursor->ts_query_cursor, start_byte, end_byte);
+    }
+    if(RTEST(rb_start_point) || RTEST(rb_end_point)) {
+      ts_query_cursor_set_point_range(query_cursor->ts_query_cursor, start_point, end_point);
+    }
+    query_cursor_set_limits(query_cursor->ts_query_cursor, rb_match_limit, rb_max_start_depth,
+                            query_cursor->match_limit, query_cursor->max_start_depth);
+    return rb_query_cursor_run(query_cursor, self, rb_node, mode, rb_packed, profile);
+  }
+
+  TSQueryCursor *cursor = spare_query_cursor;
+  if(cursor != NULL) {
+    spare_query_cursor = NULL;
+  } else {
+    cursor = ts_query_cursor_new();
+  }
+  query_cursor_set_limits(cursor, rb_match_limit, rb_max_start_depth, UINT32_MAX, UINT32_MAX);
+
+  ts_query_cursor_set_byte_range(cursor, start_byte, end_byte);
+  ts_query_cursor_set_point_range(cursor, start_point, end_point);
+  ts_query_cursor__trim_capture_lists(cursor);
+  ts_query_cursor_exec(cursor, query->ts_query, node->ts_node);
+
+  QueryRunArgs run_args = {
+    .cursor = cursor,
+    .rb_tree = node->rb_tree,
+    .query_cursor = NULL,
+    .query = query,
+    .mode = mode,
+    .rb_packed = rb_packed,
+    .profile = profile,
+  };
+
+  return query_run_exec(&run_args);
+}
+
+static VALUE
+rb_query_run(VALUE self, VALUE rb_node, VALUE rb_start_byte, VALUE rb_end_byte, VALUE rb_start_point, VALUE rb_end_point, VALUE rb_cursor,
+             VALUE rb_match_limit, VALUE rb_max_start_depth, VALUE rb_profile) {
+  return query_run(self, rb_node, rb_start_byte, rb_end_byte, rb_start_point, rb_end_point, rb_cursor,
+                   rb_match_limit, rb_max_start_depth, QUERY_RUN_MODE_RUN, Qnil, RTEST(rb_profile));
+}
+
+static VALUE
+rb_query_new_packed_buf(VALUE rb_packed) {
+  return RTEST(rb_packed) ? rb_str_buf_new(256) : Qnil;
+}
+
+/*
+ * Iterates over matches, yielding each match once.
+ * If packed is true, nothing is yielded and a binary {String} of native 32-bit
+ * (match id, pattern index, capture id, start byte, end byte) tuples is returned.
+ */
+static VALUE
+rb_query_each_match(VALUE self, VALUE rb_node, VALUE rb_start_byte, VALUE rb_end_byte, VALUE rb_start_point, VALUE rb_end_point, VALUE rb_cursor,
+                    VALUE rb_match_limit, VALUE rb_max_start_depth, VALUE rb_packed) {
+  return query_run(self, rb_node, rb_start_byte, rb_end_byte, rb_start_point, rb_end_point, rb_cursor,
+                   rb_match_limit, rb_max_start_depth, QUERY_RUN_MODE_MATCHES, rb_query_new_packed_buf(rb_packed), false);
+}
+
+/*
+ * Iterates over captures in document order, yielding each capture once.
+ * Supports packed like {#__each_match__}.
+ */
+static VALUE
+rb_query_each_capture(VALUE self, VALUE rb_node, VALUE rb_start_byte, VALUE rb_end_byte, VALUE rb_start_point, VALUE rb_end_point, VALUE rb_cursor,
+                    VALUE rb_match_limit, VALUE rb_max_start_depth, VALUE rb_packed) {
+  return query_run(self, rb_node, rb_start_byte, rb_end_byte, rb_start_point, rb_end_point, rb_cursor,
+                   rb_match_limit, rb_max_start_depth, QUERY_RUN_MODE_CAPTURES, rb_query_new_packed_buf(rb_packed), false);
+}
+
+/*
+ * Public: The capture names, indexed by capture id.
+ *
+ * Returns an {Array<Symbol>}.
+ */
+static VALUE
+rb_query_capture_names(VALUE self) {
+  Query* query;
+  TypedData_Get_Struct(self, Query, &query_type, query);
+
+  uint32_t capture_count = ts_query_capture_count(query->ts_query);
+  VALUE rb_names = rb_ary_new_capa(capture_count);
+  for(uint32_t i = 0; i < capture_count; i++) {
+    rb_ary_push(rb_names, RB_ID2SYM(query->cache_entry->capture_names[i]));
+  }
+  return rb_names;
+}
+
+static VALUE
+rb_query_pattern_count(VALUE self) {
+  Query* query;
+  TypedData_Get_Struct(self, Query, &query_type, query);
+
+  return UINT2NUM(ts_query_pattern_count(query->ts_query));
+}
+
+/*
+ * Public: The byte offset of the given pattern in the query source.
+ *
+ * Returns an {Integer}.
+ */
+static VALUE
+rb_query_pattern_start_byte(VALUE self, VALUE rb_pattern_index) {
+  Query* query;
+  TypedData_Get_Struct(self, Query, &query_type, query);
+
+  uint32_t pattern_index = FIX2UINT(rb_pattern_index);
+  if(pattern_index >= ts_query_pattern_count(query->ts_query)) {
+    rb_raise(rb_eArgError, "invalid pattern index %u", pattern_index);
+  }
+
+  return UINT2NUM(ts_query_start_byte_for_pattern(query->ts_query, pattern_index));
+}
+
+typedef struct {
+  uint32_t pattern_index;
+  uint32_t captures_start;
+  uint16_t capture_count;
+} ParallelQueryMatch;
+
+typedef struct {
+  TSQueryCursor *cursor;
+  const TSQuery *ts_query;
+  TSNode ts_node;
+  uint32_t start_byte;
+  uint32_t end_byte;
+  const volatile bool *cancelled;
+  uint32_t match_limit;
+
+  ParallelQueryMatch *matches;
+  uint32_t matches_len;
+  uint32_t matches_capa;
+  TSQueryCapture *captures;
+  uint32_t captures_len;
+  uint32_t captures_capa;
+  bool failed;
+} ParallelQueryPartition;
+
+typedef struct {
+  ParallelQueryPartition *partitions;
+  uint32_t partitions_len;
+  volatile bool cancelled;
+  VALUE rb_tree;
+  VALUE rb_input;
+  Query *query;
+  bool exceeded_match_limit;
+} ParallelQueryArgs;
+
+// runs without the GVL, so only plain malloc may be used here
+static bool
+parallel_query_partition_push(ParallelQueryPartition *partition, const TSQueryMatch *match) {
+  if(partition->matches_len == partition->matches_capa) {
+    uint32_t capa = partition->matches_capa == 0 ? 64 : partition->matches_capa * 2;
+    ParallelQueryMatch *matches = realloc(partition->matches, capa * sizeof(ParallelQueryMatch));
+    if(matches == NULL) return false;
+    partition->matches = matches;
+    partition->matches_capa = capa;
+  }
+
+  if(partition->captures_len + match->capture_count > partition->captures_capa) {
+    uint32_t capa = partition->captures_capa == 0 ? 64 : partition->captures_capa;
+    while(capa < partition->captures_len + match->capture_count) capa *= 2;
+    TSQueryCapture *captures = realloc(partition->captures, capa * sizeof(TSQueryCapture));
+    if(captures == NULL) return false;
+    partition->captures = captures;
+    partition->captures_capa = capa;
+  }
+
+  partition->matches[partition->matches_len++] = (ParallelQueryMatch) {
+    .pattern_index = match->pattern_index,
+    .captures_start = partition->captures_len,
+    .capture_count = match->capture_count,
+  };
+  memcpy(partition->captures + partition->captures_len, match->captures, match->capture_count * sizeof(TSQueryCapture));
+  partition->captures_len += match->capture_count;
+  return true;
+}
+
+static void *
+parallel_query_partition_run(void *arg) {
+  ParallelQueryPartition *partition = arg;
+  TSQueryMatch match;
+
+  ts_query_cursor_set_byte_range(partition->cursor, partition->start_byte, partition->end_byte);
+  ts_query_cursor_set_match_limit(partition->cursor, partition->match_limit);
+  ts_query_cursor_exec(partition->cursor, partition->ts_query, partition->ts_node);
+
+  while(!*partition->cancelled && ts_query_cursor_next_match(partition->cursor, &match)) {
+    // a match spanning partitions is reported by each of them;
+    // only the partition containing its first capture keeps it
+    uint32_t match_start = UINT32_MAX;
+    for(uint16_t i = 0; i < match.capture_count; i++) {
+      uint32_t start = ts_node_start_byte(match.captures[i].node);
+      if(start < match_start) match_start = start;
+    }
+    if(match.capture_count > 0 && (match_start < partition->start_byte || match_start >= partition->end_byte)) {
+      continue;
+    }
+    if(match.capture_count == 0 && partition->start_byte > 0) {
+      continue;
+    }
+
+    if(!parallel_query_partition_push(partition, &match)) {
+      partition->failed = true;
+      break;
+    }
   }
+  return NULL;
+}
 
-  Query *query = RB_ZALLOC(Query);
+static void *
+parallel_query_run_nogvl(void *arg) {
+  ParallelQueryArgs *args = arg;
+  pthread_t *threads = malloc(args->partitions_len * sizeof(pthread_t));
+  bool *started = calloc(args->partitions_len, sizeof(bool));
 
-  query->language = language;
-  query->ts_query = ts_query;
+  if(threads == NULL || started == NULL) {
+    args->partitions[0].failed = true;
+  } else {
+    // the first partition runs on the calling thread
+    for(uint32_t i = 1; i < args->partitions_len; i++) {
+      started[i] = pthread_create(&threads[i], NULL, parallel_query_partition_run, &args->partitions[i]) == 0;
+    }
+    parallel_query_partition_run(&args->partitions[0]);
+    for(uint32_t i = 1; i < args->partitions_len; i++) {
+      if(started[i]) {
+        pthread_join(threads[i], NULL);
+      } else {
+        parallel_query_partition_run(&args->partitions[i]);
+      }
+    }
+  }
 
-  return TypedData_Wrap_Struct(self, &query_type, query);
+  free(threads);
+  free(started);
+  return NULL;
 }
 
-typedef struct {
-  TSQueryCursor *cursor;
-  AstNode *node;
-} QueryRunArgs;
+static void
+parallel_query_run_ubf(void *arg) {
+  ParallelQueryArgs *args = arg;
+  args->cancelled = true;
+}
 
 static VALUE
-rb_query_run_yield(VALUE args_) {
-  QueryRunArgs *args = (QueryRunArgs *) args_;
-  uint32_t capture_index;
-  TSQueryMatch match;
-  while (ts_query_cursor_next_capture(args->cursor, &match, &capture_index)) {
-    VALUE rb_captures = rb_ary_new_capa(match.capture_count);
-    for(uint32_t i = 0; i < match.capture_count; i++) {
-      //FIXME: use match.captures[i].index to set the index of the capture.
-      rb_ary_push(rb_captures, rb_new_node(args->node->rb_tree, match.captures[i].node));
+parallel_query_yield(VALUE args_) {
+  ParallelQueryArgs *args = (ParallelQueryArgs *) args_;
+  const QueryPredicates *predicates = &args->query->cache_entry->predicates;
+  const ID *capture_names = args->query->cache_entry->capture_names;
+
+  for(uint32_t i = 0; i < args->partitions_len; i++) {
+    ParallelQueryPartition *partition = &args->partitions[i];
+    for(uint32_t j = 0; j < partition->matches_len; j++) {
+      ParallelQueryMatch *parallel_match = &partition->matches[j];
+      TSQueryMatch match = {
+        .id = j,
+        .pattern_index = parallel_match->pattern_index,
+        .capture_count = parallel_match->capture_count,
+        .captures = partition->captures + parallel_match->captures_start,
+      };
+
+      if(predicates->len > 0 &&
+         !query_predicates_satisfied(predicates, args->query->ts_query, &match,
+                                     RSTRING_PTR(args->rb_input), RSTRING_LEN(args->rb_input))) {
+        continue;
+      }
+
+      VALUE rb_captures = rb_ary_new_capa(match.capture_count);
+      VALUE rb_capture_names = rb_ary_new_capa(match.capture_count);
+      for(uint32_t k = 0; k < match.capture_count; k++) {
+        rb_ary_push(rb_captures, rb_new_node(args->rb_tree, match.captures[k].node));
+        rb_ary_push(rb_capture_names, RB_ID2SYM(capture_names[match.captures[k].index]));
+      }
+      rb_yield_values(3, rb_captures, rb_capture_names, UINT2NUM(match.pattern_index));
     }
-    rb_yield_values(2, rb_captures, UINT2NUM(match.pattern_index));
   }
   return Qnil;
 }
 
 static VALUE
-rb_query_run_ensure(VALUE args_) {
-  QueryRunArgs *args = (QueryRunArgs *) args_;
-  ts_query_cursor_delete(args->cursor);
+parallel_query_ensure(VALUE args_) {
+  ParallelQueryArgs *args = (ParallelQueryArgs *) args_;
+  for(uint32_t i = 0; i < args->partitions_len; i++) {
+    ParallelQueryPartition *partition = &args->partitions[i];
+    if(partition->cursor != NULL) {
+      ts_query_cursor_delete(partition->cursor);
+    }
+    free(partition->matches);
+    free(partition->captures);
+  }
+  xfree(args->partitions);
   return Qnil;
 }
 
 static VALUE
-rb_query_run(VALUE self, VALUE rb_node, VALUE rb_start_byte, VALUE rb_end_byte, VALUE rb_start_point, VALUE rb_end_point) {
+parallel_query_run(VALUE args_) {
+  ParallelQueryArgs *args = (ParallelQueryArgs *) args_;
+
+  rb_thread_call_without_gvl(parallel_query_run_nogvl, args, parallel_query_run_ubf, args);
+  rb_thread_check_ints();
+
+  for(uint32_t i = 0; i < args->partitions_len; i++) {
+    args->exceeded_match_limit |= ts_query_cursor_did_exceed_match_limit(args->partitions[i].cursor);
+  }
 
+  for(uint32_t i = 0; i < args->partitions_len; i++) {
+    if(args->partitions[i].failed) {
+      rb_raise(rb_eNoMemError, "failed to allocate query results");
+    }
+  }
+
+  return parallel_query_yield(args_);
+}
+
+/*
+ * Runs the query on threads native threads, each covering a contiguous
+ * range of node's children, and yields matches like {#each_match} in document order.
+ *
+ * Returns true if any partition dropped matches because of the match limit.
+ */
+static VALUE
+rb_query_run_parallel(VALUE self, VALUE rb_node, VALUE rb_threads, VALUE rb_match_limit) {
   Query* query;
   TypedData_Get_Struct(self, Query, &query_type, query);
 
-  TSPoint start_point = {.row = 0, .column = 0};
-  TSPoint end_point = {.row = UINT32_MAX, .column = UINT32_MAX};
-  unsigned start_byte = 0, end_byte = UINT32_MAX;
+  AstNode* node;
+  TypedData_Get_Struct(rb_node, AstNode, &node_type, node);
 
-  if(RTEST(rb_start_byte)) {
-    start_byte = FIX2UINT(rb_start_byte);
+  int threads = FIX2INT(rb_threads);
+  if(threads < 1) {
+    rb_raise(rb_eArgError, "threads must be positive");
   }
+  uint32_t match_limit = NIL_P(rb_match_limit) ? UINT32_MAX : NUM2UINT(rb_match_limit);
+
+  Tree *tree = rb_tree_unwrap(node->rb_tree);
+  VALUE rb_input = Qnil;
+  if(query->cache_entry->predicates.len > 0) {
+    if(NIL_P(tree->rb_input)) {
+      rb_raise(rb_eTreeSitterError, "no input attached (needed for query predicates)");
+    }
+    rb_input = rb_str_new_frozen(tree->rb_input);
+  }
+
+  // split at child boundaries into partitions of roughly equal byte size
+  uint32_t child_count = ts_node_child_count(node->ts_node);
+  uint32_t partitions_len = (uint32_t) threads < child_count ? (uint32_t) threads : child_count;
+  if(partitions_len == 0) partitions_len = 1;
+
+  uint32_t node_start = ts_node_start_byte(node->ts_node);
+  uint32_t node_end = ts_node_end_byte(node->ts_node);
+  uint64_t partition_size = ((uint64_t) node_end - node_start + partitions_len - 1) / partitions_len;
+
+  ParallelQueryArgs args = {
+    .partitions = RB_ZALLOC_N(ParallelQueryPartition, partitions_len),
+    .partitions_len = 0,
+    .cancelled = false,
+    .rb_tree = node->rb_tree,
+    .rb_input = rb_input,
+    .query = query,
+  };
+
+  uint32_t partition_start = 0;
+  for(uint32_t i = 1; i < child_count && args.partitions_len + 1 < partitions_len; i++) {
+    uint32_t child_start = ts_node_start_byte(ts_node_child(node->ts_node, i));
+    if(child_start - node_start >= partition_size * (args.partitions_len + 1)) {
+      args.partitions[args.partitions_len++] = (ParallelQueryPartition) {.start_byte = partition_start, .end_byte = child_start};
+      partition_start = child_start;
+    }
+  }
+  args.partitions[args.partitions_len++] = (ParallelQueryPartition) {.start_byte = partition_start, .end_byte = UINT32_MAX};
+
+  for(uint32_t i = 0; i < args.partitions_len; i++) {
+    ParallelQueryPartition *partition = &args.partitions[i];
+    partition->cursor = ts_query_cursor_new();
+    partition->ts_query = query->ts_query;
+    partition->ts_node = node->ts_node;
+    partition->cancelled = &args.cancelled;
+    partition->match_limit = match_limit;
+  }
+
+  rb_ensure(parallel_query_run, (VALUE) &args, parallel_query_ensure, (VALUE) &args);
+
+  RB_GC_GUARD(rb_node);
+  RB_GC_GUARD(rb_input);
+  return args.exceeded_match_limit ? Qtrue : Qfalse;
+}
+
+static VALUE
+rb_query_cursor_alloc(VALUE self)
+{
+  QueryCursor* query_cursor = RB_ZALLOC(QueryCursor);
+  query_cursor->ts_query_cursor = ts_query_cursor_new();
+  query_cursor->rb_query = Qnil;
+  query_cursor->rb_tree = Qnil;
+  query_cursor->match_limit = UINT32_MAX;
+  query_cursor->max_start_depth = UINT32_MAX;
+  return TypedData_Wrap_Struct(self, &query_cursor_type, query_cursor);
+}
 
+/*
+ * Public: Runs query on node, yielding captures like {Query#run}.
+ * The byte range, point range and limits set on the cursor are kept across calls.
+ *
+ * Returns whether matches were dropped because of the match limit.
+ */
+static VALUE
+rb_query_cursor_exec(VALUE self, VALUE rb_query, VALUE rb_node)
+{
+  QueryCursor *query_cursor = query_cursor_acquire(self);
+  return rb_query_cursor_run(query_cursor, rb_query, rb_node, QUERY_RUN_MODE_RUN, Qnil, false);
+}
+
+static VALUE
+rb_query_cursor_set_byte_range(VALUE self, VALUE rb_start_byte, VALUE rb_end_byte)
+{
+  QueryCursor *query_cursor = query_cursor_acquire(self);
+
+  unsigned start_byte = 0, end_byte = UINT32_MAX;
+  if(RTEST(rb_start_byte)) {
+    start_byte = NUM2UINT(rb_start_byte);
+  }
   if(RTEST(rb_end_byte)) {
-    end_byte = FIX2UINT(rb_end_byte);
+    end_byte = NUM2UINT(rb_end_byte);
   }
+  ts_query_cursor_set_byte_range(query_cursor->ts_query_cursor, start_byte, end_byte);
+  return self;
+}
 
+static VALUE
+rb_query_cursor_set_point_range(VALUE self, VALUE rb_start_point, VALUE rb_end_point)
+{
+  QueryCursor *query_cursor = query_cursor_acquire(self);
+
+  TSPoint start_point = {.row = 0, .column = 0};
+  TSPoint end_point = {.row = UINT32_MAX, .column = UINT32_MAX};
   if(RTEST(rb_start_point)) {
     start_point = rb_point_point_(rb_start_point);
   }
-
   if(RTEST(rb_end_point)) {
     end_point = rb_point_point_(rb_end_point);
   }
+  ts_query_cursor_set_point_range(query_cursor->ts_query_cursor, start_point, end_point);
+  return self;
+}
 
-  AstNode* node;
-  TypedData_Get_Struct(rb_node, AstNode, &node_type, node);
+static VALUE
+rb_query_cursor_match_limit(VALUE self)
+{
+  QueryCursor* query_cursor;
+  TypedData_Get_Struct(self, QueryCursor, &query_cursor_type, query_cursor);
 
-  TSQueryCursor *cursor = ts_query_cursor_new();
-  ts_query_cursor_set_byte_range(cursor, start_byte, end_byte);
-  ts_query_cursor_set_point_range(cursor, start_point, end_point);
-  ts_query_cursor_exec(cursor, query->ts_query, node->ts_node);
+  return UINT2NUM(query_cursor->match_limit);
+}
 
-  QueryRunArgs run_args = {
-    .cursor = cursor,
-    .node = node,
-  };
+static VALUE
+rb_query_cursor_set_match_limit(VALUE self, VALUE rb_limit)
+{
+  QueryCursor *query_cursor = query_cursor_acquire(self);
 
-  rb_ensure(rb_query_run_yield, (VALUE) &run_args, rb_query_run_ensure, (VALUE) &run_args);
-  return self;
+  query_cursor->match_limit = NIL_P(rb_limit) ? UINT32_MAX : NUM2UINT(rb_limit);
+  ts_query_cursor_set_match_limit(query_cursor->ts_query_cursor, query_cursor->match_limit);
+  return rb_limit;
+}
+
+static VALUE
+rb_query_cursor_set_max_start_depth(VALUE self, VALUE rb_max_start_depth)
+{
+  QueryCursor *query_cursor = query_cursor_acquire(self);
+
+  query_cursor->max_start_depth = NIL_P(rb_max_start_depth) ? UINT32_MAX : NUM2UINT(rb_max_start_depth);
+  ts_query_cursor_set_max_start_depth(query_cursor->ts_query_cursor, query_cursor->max_start_depth);
+  return rb_max_start_depth;
+}
+
+/*
+ * Public: Whether the last run on this cursor dropped matches because of its
+ * match limit. Queries are shared between threads and runs, so this is the
+ * only place the flag is kept; pass the cursor as cursor: to check it.
+ *
+ * Returns true or false.
+ */
+static VALUE
+rb_query_cursor_exceeded_match_limit_p(VALUE self)
+{
+  QueryCursor* query_cursor;
+  TypedData_Get_Struct(self, QueryCursor, &query_cursor_type, query_cursor);
+
+  return ts_query_cursor_did_exceed_match_limit(query_cursor->ts_query_cursor) ? Qtrue : Qfalse;
 }
 
 static VALUE
@@ -424,7 +1984,7 @@ rb_tree_alloc(VALUE self)
 {
   Tree* tree = RB_ZALLOC(Tree);
 
-  VALUE rb_language = rb_ivar_get(self, id___language__);
+  VALUE rb_language = rb_language_of(self);
   Language* language;
   TypedData_Get_Struct(rb_language, Language, &language_type, language);
   tree->language = language;
@@ -449,6 +2009,14 @@ rb_new_tree_path(VALUE rb_tree, TreePathNode *nodes, size_t len)
   return TypedData_Wrap_Struct(rb_cTreePath, &tree_path_type, tree_path);
 }
 
+static VALUE
+rb_new_tree_path_copy(VALUE rb_tree, const TreePathNode *nodes, size_t len)
+{
+  TreePathNode *nodes_copy = RB_ALLOC_N(TreePathNode, MAX(len, 1));
+  MEMCPY(nodes_copy, nodes, TreePathNode, len);
+  return rb_new_tree_path(rb_tree, nodes_copy, len);
+}
+
 static VALUE
 rb_tree_language(VALUE self)
 {
@@ -457,14 +2025,14 @@ rb_tree_language(VALUE self)
   (void) tree;
 
   VALUE rb_klass = rb_class_of(self);
-  VALUE rb_language = rb_ivar_get(rb_klass, id___language__);
+  VALUE rb_language = rb_language_of(rb_klass);
   return rb_language;
 }
 
 static VALUE
 rb_tree_language_s(VALUE self)
 {
-  VALUE rb_language = rb_ivar_get(self, id___language__);
+  VALUE rb_language = rb_language_of(self);
   return rb_language;
 }
 
@@ -478,6 +2046,11 @@ rb_tree_unwrap(VALUE self) {
 /*
  * Public: Creates a new tree
  *
+ * With arena: true, the tree's nodes are allocated from an arena released in one
+ * go when the tree (and every copy of it) is freed, instead of node by node.
+ * The arena keeps the space of temporaries the parser frees, so the tree takes
+ * about 40-50% more memory for valid source, and several times more for source
+ * with many syntax errors, as error recovery allocates far more temporaries.
  */
 static VALUE
 rb_tree_initialize(int argc, VALUE* argv, VALUE self)
@@ -491,21 +2064,34 @@ rb_tree_initialize(int argc, VALUE* argv, VALUE self)
   Tree* tree;
   TypedData_Get_Struct(self, Tree, &tree_type, tree);
 
+  VALUE rb_attach = Qtrue;
+  VALUE rb_arena = Qfalse;
+  if (!NIL_P(rb_options)) {
+    rb_attach = rb_hash_lookup2(rb_options, RB_ID2SYM(id_attach), Qtrue);
+    rb_arena = rb_hash_lookup2(rb_options, RB_ID2SYM(id_arena), Qfalse);
+  }
+
   Language* language = rb_tree_language_(self);
   TSLanguage *ts_language = language->ts_language;
+  int previous_tag = tracked_alloc_tag(language->id);
+  // the parser's own memory is freed again before the second reading
+  size_t bytes_before = tracked_alloc_thread_bytes();
   TSParser* parser = ts_parser_new();
-
   ts_parser_set_language(parser, ts_language);
+
+  // the parser itself stays outside the arena, it is deleted right away
+  if (RTEST(rb_arena)) {
+    tree->arena = tracked_arena_new(language->id);
+    tracked_alloc_use_arena(tree->arena);
+  }
   TSTree* ts_tree = ts_parser_parse_string(
     parser, NULL, RSTRING_PTR(rb_input), RSTRING_LEN(rb_input));
-  ts_parser_delete(parser);
+  tracked_alloc_use_arena(NULL);
 
-  tree->ts_tree = ts_tree;
+  ts_parser_delete(parser);
+  tracked_alloc_tag(previous_tag);
 
-  VALUE rb_attach = Qtrue;
-  if (!NIL_P(rb_options)) {
-    rb_attach = rb_hash_lookup2(rb_options, RB_ID2SYM(id_attach), Qtrue);
-  }
+  tree_set_ts_tree(tree, ts_tree, tracked_alloc_thread_bytes() - bytes_before);
 
   if (RTEST(rb_attach)) {
     tree->rb_input = rb_input;
@@ -538,9 +2124,23 @@ rb_tree_copy(VALUE self)
   TypedData_Get_Struct(self, Tree, &tree_type, tree);
 
   Tree* clone = RB_ZALLOC(Tree);
-  clone->ts_tree = ts_tree_copy(tree->ts_tree);
+  clone->language = tree->language;
+  int previous_tag = tracked_alloc_tag(tree->language->id);
+  // copies share the subtrees, and so the arena
+  if(tree->arena != NULL) {
+    clone->arena = tree->arena;
+    tracked_arena_retain(clone->arena);
+    tracked_alloc_use_arena(clone->arena);
+  }
+  // the subtrees are shared, the copy only allocates its own TSTree
+  size_t bytes_before = tracked_alloc_thread_bytes();
+  TSTree *ts_tree = ts_tree_copy(tree->ts_tree);
+  size_t memsize = tracked_alloc_thread_bytes() - bytes_before;
+  tracked_alloc_use_arena(NULL);
+  tracked_alloc_tag(previous_tag);
+  tree_set_ts_tree(clone, ts_tree, memsize);
   clone->rb_input = tree->rb_input;
-  return TypedData_Wrap_Struct(rb_cTree, &tree_type, clone);
+  return TypedData_Wrap_Struct(rb_class_of(self), &tree_type, clone);
 }
 
   //   VALUE rb_text = rb_node_text_(node, rb_input);
@@ -571,6 +2171,43 @@ rb_tree_copy(VALUE self)
 
 //   return start_byte_a - start_byte_b;
 // }
+/*
+ * Public: Computes the structural hashes of all nodes in one pass.
+ *
+ * Returns a binary {String} containing one native-endian 64-bit
+ * (or two for 128-bit hashes, low word first) hash per node in preorder.
+ */
+static VALUE
+rb_tree_structural_hashes(VALUE self, VALUE rb_include_text, VALUE rb_types, VALUE rb_bits)
+{
+  Tree* tree;
+  TypedData_Get_Struct(self, Tree, &tree_type, tree);
+
+  TSNode root_node = ts_tree_root_node(tree->ts_tree);
+
+  StructuralHashOptions options;
+  structural_hash_options_init(&options, tree, rb_include_text, rb_types, rb_bits);
+
+  if(!structural_hash_use_type(&options, ts_node_symbol(root_node))) {
+    structural_hash_options_destroy(&options);
+    rb_raise(rb_eArgError, "the root node's type must be in types");
+  }
+
+  size_t node_count = ts_node_descendant_count(root_node);
+  StructuralHash *hashes = RB_ALLOC_N(StructuralHash, node_count);
+  size_t len = structural_hash_node(root_node, &options, hashes, NULL);
+  structural_hash_options_destroy(&options);
+
+  size_t words_per_hash = options.wide ? 2 : 1;
+  VALUE rb_buf = rb_str_buf_new(len * words_per_hash * sizeof(uint64_t));
+  for(size_t i = 0; i < len; i++) {
+    rb_str_cat(rb_buf, (const char *) &hashes[i], words_per_hash * sizeof(uint64_t));
+  }
+  xfree(hashes);
+
+  return rb_buf;
+}
+
 
 static VALUE
 rb_tree_attach(VALUE self, VALUE rb_input)
@@ -789,54 +2426,43 @@ rb_tree_find_common_parent(int argc, VALUE *argv, VALUE self) {
 //   }
 // }
 
-static void
-find_path_by_byte(VALUE rb_tree, Language *language, TSNode node, uint32_t min_byte, uint32_t max_byte, TreePathNode **nodes_out, size_t *nodes_len_out) {
-  TSTreeCursor tree_cursor = ts_tree_cursor_new(node);
-  TSNode current_node = node;
-  TSFieldId current_field_id = 0;
+static inline bool
+node_contains_bytes(TSNode node, uint32_t min_byte, uint32_t max_byte) {
+  return ts_node_start_byte(node) <= min_byte && ts_node_end_byte(node) > max_byte;
+}
 
-  size_t nodes_capa = 16;
-  size_t nodes_len = 0;
-  TreePathNode *nodes = RB_ZALLOC_N(TreePathNode, nodes_capa);
+// Moves the cursor from its current node down to the deepest descendant that
+// contains min_byte..max_byte (it stays put if the current node doesn't).
+// If nodes is not NULL, every node on the way, starting with the current one,
+// is appended to it; nodes must then have room for the tree's max path length.
+static void
+tree_cursor_descend_by_byte(TSTreeCursor *tree_cursor, uint32_t min_byte, uint32_t max_byte, TreePathNode *nodes, size_t *nodes_len) {
+  if(!node_contains_bytes(ts_tree_cursor_current_node(tree_cursor), min_byte, max_byte)) {
+    return;
+  }
 
+  uint32_t mid_byte = (uint32_t) (((uint64_t) max_byte + (uint64_t) min_byte) / 2);
   while(true) {
-    uint32_t mid_byte = (uint32_t) (((uint64_t)max_byte + (uint64_t) min_byte) / 2);
-    int64_t ret = ts_tree_cursor_goto_first_child_for_byte(&tree_cursor, mid_byte);
-
-    // if ret == -1 we are at the goal node, so we want the node, not its type
-    uint32_t start_byte = ts_node_start_byte(current_node);
-    uint32_t end_byte = ts_node_end_byte(current_node);
-
-    // fprintf(stderr, "min/max byte: %d/%d/%d\n", min_byte, max_byte, mid_byte);
-    // fprintf(stderr, "start/end byte: %d/%d\n", start_byte, end_byte);
-
-    if(start_byte <= min_byte && end_byte > max_byte) {
-      if(nodes_len == nodes_capa) {
-        size_t new_capa = nodes_capa * 2;
-        RB_REALLOC_N(nodes, TreePathNode, new_capa);
-        nodes_capa = new_capa;
-      } else {
-        TreePathNode path_node = {
-          .ts_node = current_node,
-          .field_id = current_field_id
-        };
-        nodes[nodes_len++] = path_node;
-      }
+    if(nodes != NULL) {
+      nodes[(*nodes_len)++] = (TreePathNode) {
+        .ts_node = ts_tree_cursor_current_node(tree_cursor),
+        .field_id = ts_tree_cursor_current_field_id(tree_cursor)
+      };
     }
 
-    if(ret == -1) {
+    if(ts_tree_cursor_goto_first_child_for_byte(tree_cursor, mid_byte) == -1) {
       break;
-    } 
-
-    current_field_id = ts_tree_cursor_current_field_id(&tree_cursor);
-    current_node = ts_tree_cursor_current_node(&tree_cursor);
+    }
+    if(!node_contains_bytes(ts_tree_cursor_current_node(tree_cursor), min_byte, max_byte)) {
+      ts_tree_cursor_goto_parent(tree_cursor);
+      break;
+    }
   }
-  ts_tree_cursor_delete(&tree_cursor);
-
-  *nodes_out = nodes;
-  *nodes_len_out = nodes_len;
 }
 
+static VALUE
+rb_new_tree_path_copy(VALUE rb_tree, const TreePathNode *nodes, size_t len);
+
 static void
 get_min_max_byte(VALUE rb_token_node_or_goal_byte, uint32_t *min_byte, uint32_t *max_byte) {
   switch(rb_type(rb_token_node_or_goal_byte)) {
@@ -891,50 +2517,172 @@ rb_tree_path_to(VALUE self, VALUE rb_token_node_or_goal_byte) {
   uint32_t max_byte = 0;
 
   get_min_max_byte(rb_token_node_or_goal_byte, &min_byte, &max_byte);
-  Language *language = rb_tree_language_(self);
 
-  size_t nodes_len;
-  TreePathNode *nodes;
-  find_path_by_byte(self, language, root_node, min_byte, max_byte, &nodes, &nodes_len);
+  size_t nodes_len = 0;
+  TreePathNode *nodes = RB_ALLOC_N(TreePathNode, tree_max_path_len(tree));
+  TSTreeCursor tree_cursor = ts_tree_cursor_new(root_node);
+  tree_cursor_descend_by_byte(&tree_cursor, min_byte, max_byte, nodes, &nodes_len);
+  ts_tree_cursor_delete(&tree_cursor);
 
-  VALUE rb_path = rb_new_tree_path(self, nodes, nodes_len);
-  return rb_path;
+  return rb_new_tree_path(self, nodes, nodes_len);
 }
 
+static int
+byte_offset_cmp(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+  return (x > y) - (x < y);
+}
 
-static TSNode
-find_node_by_byte(VALUE rb_tree, Language *language, TSNode node, uint32_t min_byte, uint32_t max_byte) {
-  TSTreeCursor tree_cursor = ts_tree_cursor_new(node);
-  TSNode found_node = {0, };
+// Returns the offsets as (byte offset << 32 | index in rb_byte_offsets), sorted
+// by offset; free with xfree. len must be > 0.
+static uint64_t *
+byte_offsets_sorted(VALUE rb_byte_offsets, size_t len) {
+  // offsets are checked before order is allocated, so a bad one can't leak it
+  for(size_t i = 0; i < len; i++) {
+    VALUE rb_byte = RARRAY_AREF(rb_byte_offsets, (long) i);
+    if(!RB_INTEGER_TYPE_P(rb_byte)) {
+      rb_raise(rb_eTypeError, "byte offsets must be Integers");
+    }
+    NUM2UINT(rb_byte);
+  }
 
-  uint32_t mid_byte = max_byte / 2 + min_byte / 2;
+  uint64_t *order = RB_ALLOC_N(uint64_t, len);
+  for(size_t i = 0; i < len; i++) {
+    uint32_t byte = (uint32_t) NUM2UINT(RARRAY_AREF(rb_byte_offsets, (long) i));
+    order[i] = ((uint64_t) byte << 32) | (uint64_t) i;
+  }
+  qsort(order, len, sizeof(uint64_t), byte_offset_cmp);
+  return order;
+}
 
-  fprintf(stderr, "MIN/MAX %d/%d => %d\n", min_byte, max_byte, mid_byte);
+/*
+ * Public: Paths to many byte offsets at once.
+ * Offsets are visited in sorted order, so each descent starts from the deepest node
+ * shared with the previous path instead of the root.
+ *
+ * Returns an {Array} of {Path}, in the order of byte_offsets.
+ */
+static VALUE
+rb_tree_paths_to(VALUE self, VALUE rb_byte_offsets) {
+  Tree* tree;
+  TypedData_Get_Struct(self, Tree, &tree_type, tree);
+  Check_Type(rb_byte_offsets, T_ARRAY);
 
-  while(true) {
-    int64_t ret = ts_tree_cursor_goto_first_child_for_byte(&tree_cursor, mid_byte);
-    TSNode node = ts_tree_cursor_current_node(&tree_cursor);
+  long len = RARRAY_LEN(rb_byte_offsets);
+  VALUE rb_paths = rb_ary_new_capa(len);
+  if(len == 0) {
+    return rb_paths;
+  }
 
-    uint32_t start_byte = ts_node_start_byte(node);
-    uint32_t end_byte = ts_node_end_byte(node);
+  uint64_t *order = byte_offsets_sorted(rb_byte_offsets, (size_t) len);
+  for(long i = 0; i < len; i++) {
+    rb_ary_push(rb_paths, Qnil);
+  }
 
-    fprintf(stderr, "START/END %s %d/%d\n", ts_node_type(node), start_byte, end_byte);
+  TreePathNode *nodes = RB_ALLOC_N(TreePathNode, tree_max_path_len(tree));
+  size_t nodes_len = 0;
+  TSNode root_node = ts_tree_root_node(tree->ts_tree);
+  TSTreeCursor tree_cursor = ts_tree_cursor_new(root_node);
+
+  for(long i = 0; i < len; i++) {
+    uint32_t byte = (uint32_t) (order[i] >> 32);
+    long index = (long) (order[i] & UINT32_MAX);
+
+    // keep the prefix of the previous path that still contains byte
+    size_t keep = 0;
+    while(keep < nodes_len &&
+          ts_node_start_byte(nodes[keep].ts_node) <= byte &&
+          ts_node_end_byte(nodes[keep].ts_node) > byte) {
+      keep++;
+    }
 
-    if(start_byte <= min_byte && end_byte > max_byte) {
-      found_node = node;
+    if(keep == 0) {
+      nodes_len = 0;
+      ts_tree_cursor_reset(&tree_cursor, root_node);
+      tree_cursor_descend_by_byte(&tree_cursor, byte, byte, nodes, &nodes_len);
     } else {
-      break;
+      // descend below the deepest kept node, which is already on the path
+      nodes_len = keep - 1;
+      TreePathNode deepest = nodes[nodes_len];
+      ts_tree_cursor_reset(&tree_cursor, deepest.ts_node);
+      tree_cursor_descend_by_byte(&tree_cursor, byte, byte, nodes, &nodes_len);
+      nodes[keep - 1].field_id = deepest.field_id;
     }
 
-    if(ret == -1) {
-      break;
-    } 
+    rb_ary_store(rb_paths, index, rb_new_tree_path_copy(self, nodes, nodes_len));
+  }
+
+  ts_tree_cursor_delete(&tree_cursor);
+  xfree(nodes);
+  xfree(order);
+  return rb_paths;
+}
+
+
+static TSNode
+find_node_by_byte(TSNode node, uint32_t min_byte, uint32_t max_byte) {
+  if(!node_contains_bytes(node, min_byte, max_byte)) {
+    return (TSNode) {0, };
   }
 
+  TSTreeCursor tree_cursor = ts_tree_cursor_new(node);
+  tree_cursor_descend_by_byte(&tree_cursor, min_byte, max_byte, NULL, NULL);
+  TSNode found_node = ts_tree_cursor_current_node(&tree_cursor);
   ts_tree_cursor_delete(&tree_cursor);
   return found_node;
 }
 
+/*
+ * Public: The deepest node containing each of the given byte offsets.
+ * Offsets are resolved in sorted order by a single cursor, which only climbs
+ * as far as needed between consecutive offsets.
+ *
+ * Returns an {Array} of {Node} (nil for offsets outside the tree), in the order of byte_offsets.
+ */
+static VALUE
+rb_tree_nodes_at(VALUE self, VALUE rb_byte_offsets) {
+  Tree* tree;
+  TypedData_Get_Struct(self, Tree, &tree_type, tree);
+  Check_Type(rb_byte_offsets, T_ARRAY);
+
+  long len = RARRAY_LEN(rb_byte_offsets);
+  VALUE rb_nodes = rb_ary_new_capa(len);
+  if(len == 0) {
+    return rb_nodes;
+  }
+
+  uint64_t *order = byte_offsets_sorted(rb_byte_offsets, (size_t) len);
+  for(long i = 0; i < len; i++) {
+    rb_ary_push(rb_nodes, Qnil);
+  }
+
+  TSNode root_node = ts_tree_root_node(tree->ts_tree);
+  TSTreeCursor tree_cursor = ts_tree_cursor_new(root_node);
+
+  for(long i = 0; i < len; i++) {
+    uint32_t byte = (uint32_t) (order[i] >> 32);
+    long index = (long) (order[i] & UINT32_MAX);
+
+    if(!node_contains_bytes(root_node, byte, byte)) {
+      continue;
+    }
+
+    while(!node_contains_bytes(ts_tree_cursor_current_node(&tree_cursor), byte, byte)) {
+      ts_tree_cursor_goto_parent(&tree_cursor);
+    }
+    tree_cursor_descend_by_byte(&tree_cursor, byte, byte, NULL, NULL);
+
+    rb_ary_store(rb_nodes, index,
+                 rb_new_node_with_field(self, ts_tree_cursor_current_node(&tree_cursor),
+                                        ts_tree_cursor_current_field_id(&tree_cursor)));
+  }
+
+  ts_tree_cursor_delete(&tree_cursor);
+  xfree(order);
+  return rb_nodes;
+}
+
 static VALUE
 rb_tree_find_by_byte(VALUE self, VALUE rb_goal_byte) {
   Tree* tree;
@@ -957,9 +2705,7 @@ rb_tree_find_by_byte(VALUE self, VALUE rb_goal_byte) {
   }
 
   TSNode root_node = ts_tree_root_node(tree->ts_tree);
-  Language *language = rb_tree_language_(self);
-
-  TSNode node = find_node_by_byte(self, language, root_node, min_byte, max_byte);
+  TSNode node = find_node_by_byte(root_node, min_byte, max_byte);
   if(ts_node_is_null(node)) {
     return Qnil;
   } else {
@@ -1026,9 +2772,17 @@ rb_tree_cursor_copy(VALUE self)
 
 static VALUE
 rb_tree_path_get_node(TreePath *tree_path, long index) {
-  TreePathNode path_node = tree_path->nodes[index];
-  /*TODO: add option to cache Ruby nodes */
-  return rb_new_node_with_field(tree_path->rb_tree, path_node.ts_node, path_node.field_id);
+  if(tree_path->rb_nodes == NULL) {
+    tree_path->rb_nodes = RB_ZALLOC_N(VALUE, MAX(tree_path->len, 1));
+  }
+
+  VALUE rb_node = tree_path->rb_nodes[index];
+  if(rb_node == 0) {
+    TreePathNode path_node = tree_path->nodes[index];
+    rb_node = rb_new_node_with_field(tree_path->rb_tree, path_node.ts_node, path_node.field_id);
+    tree_path->rb_nodes[index] = rb_node;
+  }
+  return rb_node;
 }
 
 static VALUE
@@ -1173,7 +2927,6 @@ rb_tree_path_find_by_type(VALUE self, VALUE rb_elems, VALUE rb_before, VALUE rb_
     return Qnil;
   } else {
     VALUE rb_node = rb_tree_path_get_node(tree_path, index);
-    rb_p(rb_node);
     if(RB_TEST(rb_return_index)) {
       return rb_assoc_new(rb_node, LONG2FIX(index));
     } else {
@@ -1227,6 +2980,10 @@ rb_tree_path_first(VALUE self)
   TreePath* tree_path;
   TypedData_Get_Struct(self, TreePath, &tree_path_type, tree_path);
 
+  if(tree_path->len == 0) {
+    return Qnil;
+  }
+
   return rb_tree_path_get_node(tree_path, 0);
 }
 
@@ -1266,17 +3023,43 @@ rb_tree_path_each(VALUE self)
   return self;
 }
 
+/*
+ * Public: Native memory held by live trees, compiled queries and snapshots,
+ * which the Ruby heap does not see, and the bytes currently allocated by the
+ * runtime overall (live_bytes) and outside of any language (untagged_bytes).
+ *
+ * Returns a {Hash} of counts and byte sizes.
+ */
+static VALUE
+rb_tree_sitter_memory_stats(VALUE self)
+{
+  VALUE rb_stats = rb_hash_new();
+  rb_hash_aset(rb_stats, CSTR2SYM("trees"), SIZET2NUM(memory_stats.trees));
+  rb_hash_aset(rb_stats, CSTR2SYM("tree_bytes"), SIZET2NUM(memory_stats.tree_bytes));
+  rb_hash_aset(rb_stats, CSTR2SYM("queries"), SIZET2NUM(memory_stats.queries));
+  rb_hash_aset(rb_stats, CSTR2SYM("query_bytes"), SIZET2NUM(memory_stats.query_bytes));
+  rb_hash_aset(rb_stats, CSTR2SYM("snapshots"), SIZET2NUM(memory_stats.snapshots));
+  rb_hash_aset(rb_stats, CSTR2SYM("snapshot_bytes"), SIZET2NUM(memory_stats.snapshot_bytes));
+  rb_hash_aset(rb_stats, CSTR2SYM("live_bytes"), SIZET2NUM(tracked_alloc_live_bytes()));
+  rb_hash_aset(rb_stats, CSTR2SYM("live_allocations"), SIZET2NUM(tracked_alloc_live_count()));
+  rb_hash_aset(rb_stats, CSTR2SYM("untagged_bytes"), SIZET2NUM(tracked_alloc_language_live_bytes(TRACKED_ALLOC_UNTAGGED)));
+  return rb_stats;
+}
+
 void
 init_tree()
 {
   id_types = rb_intern("types");
   id_attach = rb_intern("attach");
+  id_arena = rb_intern("arena");
   id_whitespace = rb_intern("whitespace");
   id___language__ = rb_intern("@__language__");
   id_error = rb_intern("error");
   id_invalid = rb_intern("invalid");
 
   VALUE rb_mTreeSitter = rb_define_module("TreeSitter");
+  rb_define_module_function(rb_mTreeSitter, "memory_stats", rb_tree_sitter_memory_stats, 0);
+
   rb_cTree = rb_define_class_under(rb_mTreeSitter, "Tree", rb_cObject);
   rb_define_alloc_func(rb_cTree, rb_tree_alloc);
   rb_define_method(rb_cTree, "initialize", rb_tree_initialize, -1);
@@ -1287,10 +3070,14 @@ init_tree()
   rb_define_singleton_method(rb_cTree, "language", rb_tree_language_s, 0);
 
   rb_define_method(rb_cTree, "__path_to__", rb_tree_path_to, 1);
+  rb_define_method(rb_cTree, "paths_to", rb_tree_paths_to, 1);
+  rb_define_method(rb_cTree, "nodes_at", rb_tree_nodes_at, 1);
   rb_define_method(rb_cTree, "__find_by_byte__", rb_tree_find_by_byte, 1);
   // rb_define_singleton_method(rb_cTree, "merge", rb_tree_merge, -1);
   rb_define_singleton_method(rb_cTree, "find_common_parent", rb_tree_find_common_parent, -1);
 
+  rb_define_private_method(rb_cTree, "__structural_hashes__", rb_tree_structural_hashes, 3);
+
   rb_define_method(rb_cTree, "clone", rb_tree_copy, 0);
   rb_define_method(rb_cTree, "copy", rb_tree_copy, 0);
 
@@ -1325,13 +3112,32 @@ init_tree()
   rb_cLanguage = rb_define_class_under(rb_mTreeSitter, "Language", rb_cObject);
   rb_undef_alloc_func(rb_cLanguage);
 
+  // placeholder for a language that hasn't been built yet, see rb_language_of
+  rb_cLazyLanguage = rb_define_class_under(rb_cLanguage, "Lazy", rb_cObject);
+  rb_undef_alloc_func(rb_cLazyLanguage);
+
   rb_define_method(
     rb_cLanguage, "fields", rb_language_fields, 0);
 
   rb_define_method(
     rb_cLanguage, "symbols", rb_language_symbols, 0);
 
+  rb_define_method(
+    rb_cLanguage, "live_bytes", rb_language_live_bytes, 0);
+  rb_define_method(
+    rb_cLanguage, "query_cache_capacity", rb_language_query_cache_capacity, 0);
+
+  rb_define_method(
+    rb_cLanguage, "query_cache_capacity=", rb_language_set_query_cache_capacity, 1);
+
+  rb_define_method(
+    rb_cLanguage, "query_cache_size", rb_language_query_cache_size, 0);
+
+  rb_define_method(
+    rb_cLanguage, "clear_query_cache", rb_language_clear_query_cache, 0);
+
   rb_cTreePath = rb_define_class_under(rb_cTree, "Path", rb_cObject);
+  rb_undef_alloc_func(rb_cTreePath);
   rb_include_module(rb_cTreePath, rb_mEnumerable);
   rb_define_method(rb_cTreePath, "[]", rb_tree_path_aref, 1);
   rb_define_method(rb_cTreePath, "at", rb_tree_path_at, 1);
@@ -1346,7 +3152,23 @@ init_tree()
   rb_define_method(rb_cTreePath, "to_s", rb_tree_path_to_s, 0);
 
   VALUE rb_cQuery = rb_define_class_under(rb_cTree, "Query", rb_cObject);
-  rb_define_singleton_method(rb_cQuery, "new", rb_query_new, 1);
+  rb_define_singleton_method(rb_cQuery, "__new__", rb_query_new, 2);
   rb_undef_alloc_func(rb_cQuery);
-  rb_define_method(rb_cQuery, "__run__", rb_query_run, 5);
+  rb_define_method(rb_cQuery, "__run__", rb_query_run, 9);
+  rb_define_method(rb_cQuery, "__each_match__", rb_query_each_match, 9);
+  rb_define_method(rb_cQuery, "__each_capture__", rb_query_each_capture, 9);
+  rb_define_method(rb_cQuery, "capture_names", rb_query_capture_names, 0);
+  rb_define_method(rb_cQuery, "pattern_count", rb_query_pattern_count, 0);
+  rb_define_method(rb_cQuery, "pattern_start_byte", rb_query_pattern_start_byte, 1);
+  rb_define_method(rb_cQuery, "__run_parallel__", rb_query_run_parallel, 3);
+
+  rb_cQueryCursor = rb_define_class_under(rb_cQuery, "Cursor", rb_cObject);
+  rb_define_alloc_func(rb_cQueryCursor, rb_query_cursor_alloc);
+  rb_define_method(rb_cQueryCursor, "exec", rb_query_cursor_exec, 2);
+  rb_define_method(rb_cQueryCursor, "set_byte_range", rb_query_cursor_set_byte_range, 2);
+  rb_define_method(rb_cQueryCursor, "set_point_range", rb_query_cursor_set_point_range, 2);
+  rb_define_method(rb_cQueryCursor, "match_limit", rb_query_cursor_match_limit, 0);
+  rb_define_method(rb_cQueryCursor, "match_limit=", rb_query_cursor_set_match_limit, 1);
+  rb_define_method(rb_cQueryCursor, "max_start_depth=", rb_query_cursor_set_max_start_depth, 1);
+  rb_define_method(rb_cQueryCursor, "exceeded_match_limit?", rb_query_cursor_exceeded_match_limit_p, 0);
 }
@@ -3,28 +3,97 @@
 #include "ruby.h"
 #include "tree_sitter/api.h"
 #include "language_ids.h"
+#include "name_map.h"
 
 typedef struct {
   TSTreeCursor ts_tree_cursor;
   VALUE rb_tree;
 } TreeCursor;
 
+#define QUERY_CACHE_DEFAULT_CAPA 32
+
+typedef enum {
+  QUERY_PREDICATE_EQ,
+  QUERY_PREDICATE_MATCH,
+  QUERY_PREDICATE_ANY_OF,
+} QueryPredicateType;
+
+typedef struct {
+  uint8_t type;
+  bool negated;
+  bool any;
+  bool capture_arg;
+  uint32_t capture_id;
+  uint32_t arg_capture_id;
+  // string arguments point into the query's string table
+  uint32_t strings_start;
+  uint32_t strings_len;
+  struct re_pattern_buffer *regex;
+} QueryPredicate;
+
+typedef struct {
+  QueryPredicate *predicates;
+  uint32_t *pattern_offsets;
+  uint32_t *string_ids;
+  uint32_t len;
+} QueryPredicates;
+
+typedef struct QueryCacheEntry {
+  TSQuery *ts_query;
+  QueryPredicates predicates;
+  size_t ts_query_memsize;
+  ID *capture_names;
+  char *source;
+  size_t source_len;
+  uint32_t refcount;
+  bool cached;
+  struct QueryCacheEntry *prev;
+  struct QueryCacheEntry *next;
+} QueryCacheEntry;
+
+typedef struct {
+  st_table *table;
+  QueryCacheEntry *head;
+  QueryCacheEntry *tail;
+  size_t len;
+  size_t capa;
+} QueryCache;
+
 typedef struct {
   LanguageId id;
   TSLanguage *ts_language;
-  st_table *ts_symbol_table;
+  // both directions are filled on demand: ids are interned the first time a
+  // symbol or field is named, the name maps built on the first lookup by name
+  NameMap *symbol_map;
   ID *ts_symbol2id;
   size_t field_count;
   size_t symbol_count;
 
-  st_table *ts_field_table;
+  NameMap *field_map;
   ID *ts_field2id;
+
+  QueryCache query_cache;
 } Language;
 
+typedef struct {
+  st_table *rows;
+  TSNode *nodes;
+  int32_t *parents;
+  TSFieldId *fields;
+  uint32_t len;
+} TreeAncestorCache;
+
 typedef struct {
   TSTree *ts_tree;
   VALUE rb_input;
   Language *language;
+  TreeAncestorCache *ancestor_cache;
+  // number of nodes on the longest root-to-leaf path, 0 if not computed yet
+  uint32_t max_path_len;
+  // bytes held by ts_tree (or its arena)
+  size_t ts_tree_memsize;
+  // set if ts_tree was allocated from an arena, shared with copies
+  struct TrackedArena *arena;
 } Tree;
 
 typedef struct {
@@ -36,19 +105,68 @@ typedef struct {
   TreePathNode *nodes;
   uint32_t len;
   VALUE rb_tree;
+  VALUE *rb_nodes;
 } TreePath;
 
 typedef struct {
   Language *language;
   TSQuery *ts_query;
+  QueryCacheEntry *cache_entry;
 } Query;
 
+typedef struct {
+  TSQueryCursor *ts_query_cursor;
+  VALUE rb_query;
+  VALUE rb_tree;
+  bool running;
+  // the cursor's own limits, restored after runs with per-call ones
+  uint32_t match_limit;
+  uint32_t max_start_depth;
+} QueryCursor;
+
+typedef struct {
+  uint64_t matches;
+  uint64_t rejected;
+  uint64_t ns;
+} QueryPatternStats;
+
+// defined in lib.c, which sees the cursor internals;
+// counts are incremented per pattern whenever a query state is started
+void ts_query_cursor__set_pattern_state_counts(TSQueryCursor *self, uint64_t *pattern_state_counts);
+
+// defined in lib.c; the match limit only caps newly allocated capture lists,
+// so this drops the lists a previous run grew beyond it. Call before exec.
+void ts_query_cursor__trim_capture_lists(TSQueryCursor *self);
+
+// defined in lib.c; makes cursors return the pattern's captures only once its match is finished
+void ts_query__hold_pattern_captures(TSQuery *self, uint32_t pattern_index);
+
+// defined in lib.c; heap bytes allocated by the runtime (not the Ruby heap) for each object
+size_t ts_tree_cursor__memsize(const TSTreeCursor *self);
+size_t ts_query__memsize(const TSQuery *self);
+size_t ts_query_cursor__memsize(const TSQueryCursor *self);
+
+// Live objects and their native bytes by kind, see TreeSitter.memory_stats.
+// Only updated with the GVL held.
+typedef struct {
+  size_t trees;
+  size_t tree_bytes;
+  size_t queries;
+  size_t query_bytes;
+  size_t snapshots;
+  size_t snapshot_bytes;
+} MemoryStats;
+
+extern MemoryStats memory_stats;
+
 VALUE rb_tree_path_to(VALUE self, VALUE rb_token_node_or_goal_byte);
 
 #include "node.h"
 
 void init_tree();
 VALUE rb_new_language(TSLanguage *ts_language, LanguageId id);
+void rb_define_lazy_language(VALUE rb_klass, VALUE rb_query_klass, const TSLanguage *(*ts_language)(void), LanguageId id);
+VALUE rb_language_of(VALUE rb_klass);
 
 Tree *rb_tree_unwrap(VALUE rb_tree);
 
@@ -64,6 +182,10 @@ rb_tree_language_(VALUE self) {
 
 extern ID id_error;
 extern ID id_invalid;
+extern ID id___language__;
+
+ID language_intern_symbol(Language *language, TSSymbol symbol);
+ID language_intern_field(Language *language, TSFieldId field_id);
 
 static inline ID
 language_symbol2id(Language *language, TSSymbol symbol) {
@@ -73,15 +195,30 @@ language_symbol2id(Language *language, TSSymbol symbol) {
   if(symbol >= language->symbol_count) {
     return id_invalid;
   }
-  return language->ts_symbol2id[symbol];
+  ID id = language->ts_symbol2id[symbol];
+  return RB_LIKELY(id != 0) ? id : language_intern_symbol(language, symbol);
 }
 
 static inline ID
 language_field2id(Language *language, TSFieldId field_id) {
-  if(field_id >= language->field_count + 1 || field_id == 0) {
+  if(field_id >= language->field_count || field_id == 0) {
     return id_invalid;
   }
-  return language->ts_field2id[field_id];
+  ID id = language->ts_field2id[field_id];
+  return RB_LIKELY(id != 0) ? id : language_intern_field(language, field_id);
+}
+
+TreeAncestorCache *tree_ancestor_cache(Tree *tree);
+uint32_t tree_max_path_len(Tree *tree);
+
+static inline bool
+tree_ancestor_cache_row(TreeAncestorCache *cache, TSNode ts_node, uint32_t *row) {
+  st_data_t value;
+  if(st_lookup(cache->rows, (st_data_t) ts_node.id, &value)) {
+    *row = (uint32_t) value;
+    return true;
+  }
+  return false;
 }
 
 bool language_id2field(Language *language, ID id, TSFieldId *field_id);
@@ -0,0 +1,62 @@
+require 'mkmf'
+require_relative '../core/build_profile'
+
+# A single extension containing every grammar under ext/, as an alternative to
+# loading one extension per language. It is only built when TREE_SITTER_FAT is
+# set (see `rake compile:languages`).
+unless ENV['TREE_SITTER_FAT']
+  File.write('Makefile', dummy_makefile($srcdir).join)
+  exit
+end
+
+$INCFLAGS << ' -I$(srcdir)/../core/vendor/include -I$(srcdir)/../core'
+
+ext_dir = File.expand_path('..', __dir__)
+api_h = File.binread(File.join(ext_dir, 'core', 'vendor', 'include', 'tree_sitter', 'api.h'))
+min_version, max_version = %w[TREE_SITTER_MIN_COMPATIBLE_LANGUAGE_VERSION TREE_SITTER_LANGUAGE_VERSION].map do |name|
+  Integer(api_h[/#define #{name} (\d+)/, 1])
+end
+grammar_sources = %w[parser.c scanner.c scanner.cc]
+
+# each grammar file is compiled through a wrapper in the build directory (the
+# grammars' object names would collide otherwise), with the grammar's own
+# directory first on the include path for its tree_sitter/parser.h
+dialects = []
+srcs = [File.join($srcdir, 'languages.c')]
+include_dirs = {}
+Dir.children(ext_dir).sort.each do |dialect|
+  dir = File.join(ext_dir, dialect)
+  parser = File.join(dir, 'parser.c')
+  next unless File.exist?(parser) && File.exist?(File.join(dir, 'tree_sitter', 'parser.h'))
+
+  version = Integer(File.foreach(parser, mode: 'rb').lazy.filter_map { _1[/#define LANGUAGE_VERSION (\d+)/, 1] }.first)
+  unless (min_version..max_version).cover?(version)
+    message "skipping #{dialect}: generated for language version #{version}\n"
+    next
+  end
+
+  grammar_sources.each do |filename|
+    path = File.join(dir, filename)
+    next unless File.exist?(path)
+
+    wrapper = "#{dialect}_#{filename.tr('.', '_')}#{File.extname(filename)}"
+    File.write(wrapper, %(#include "#{path}"\n))
+    srcs << wrapper
+    include_dirs["#{File.basename(wrapper, '.*')}.#{$OBJEXT}"] = dir
+  end
+  dialects << dialect
+end
+abort 'no generated grammars under ext/' if dialects.empty?
+message "bundling #{dialects.join(' ')}\n"
+
+File.write('languages_table.h', dialects.map { |dialect|
+  "LANGUAGE(#{dialect}, #{dialect.split('_').map(&:capitalize).join}, LANGUAGE_#{dialect.upcase})\n"
+}.join)
+
+$srcs = srcs
+$objs = srcs.map { "#{File.basename(_1, '.*')}.#{$OBJEXT}" }
+create_makefile('languages')
+
+File.open('Makefile', 'a') do |makefile|
+  include_dirs.each { |obj, dir| makefile.puts "#{obj}: INCFLAGS := -I#{dir} $(INCFLAGS)" }
+end
@@ -0,0 +1,41 @@
+#include "ruby.h"
+#include "tree_sitter/api.h"
+#include "language_ids.h"
+
+// languages_table.h is generated by extconf.rb: one
+// LANGUAGE(dialect, ClassName, LANGUAGE_ID) per bundled grammar
+#define LANGUAGE(dialect, class_name, id) extern const TSLanguage *tree_sitter_##dialect(void);
+#include "languages_table.h"
+#undef LANGUAGE
+
+extern void rb_define_lazy_language(VALUE rb_klass, VALUE rb_query_klass, const TSLanguage *(*ts_language)(void), LanguageId id);
+
+typedef struct {
+  const char *feature;
+  const char *class_name;
+  const TSLanguage *(*ts_language)(void);
+  LanguageId id;
+} BundledLanguage;
+
+static const BundledLanguage bundled_languages[] = {
+#define LANGUAGE(dialect, class_name, id) { "tree_sitter/" #dialect ".so", #class_name, tree_sitter_##dialect, id },
+#include "languages_table.h"
+#undef LANGUAGE
+};
+
+void Init_languages()
+{
+  VALUE mTreeSitter = rb_const_get(rb_cObject, rb_intern("TreeSitter"));
+  VALUE cTree = rb_const_get(mTreeSitter, rb_intern("Tree"));
+  VALUE cQuery = rb_const_get(cTree, rb_intern("Query"));
+
+  for(size_t i = 0; i < sizeof(bundled_languages) / sizeof(bundled_languages[0]); i++) {
+    const BundledLanguage *bundled = &bundled_languages[i];
+    VALUE rb_klass = rb_define_class_under(mTreeSitter, bundled->class_name, cTree);
+    VALUE rb_query_klass = rb_define_class_under(rb_klass, "Query", cQuery);
+    rb_define_lazy_language(rb_klass, rb_query_klass, bundled->ts_language, bundled->id);
+
+    // makes `require "tree_sitter/<dialect>"` (and so Tree.for_filename) a no-op
+    rb_provide(bundled->feature);
+  }
+}
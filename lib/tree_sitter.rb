@@ -6,5 +6,9 @@ require_relative 'tree_sitter/tree'
 require_relative 'tree_sitter/node'
 require_relative 'tree_sitter/token'
 
+# every grammar in a single extension, if it was built (TREE_SITTER_FAT=1)
+languages = File.join(__dir__, 'tree_sitter', "languages.#{RbConfig::CONFIG['DLEXT']}")
+require languages if File.exist?(languages)
+
 module TreeSitter
 end
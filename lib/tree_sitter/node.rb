@@ -13,8 +13,22 @@ module TreeSitter
       Tree::Cursor.new self
     end
 
-    def to_h(byte_ranges: false, unnamed: false)
-      __to_h__(byte_ranges, unnamed)
+    # Type and field values are frozen strings shared across nodes, or Symbols
+    # with symbols: true.
+    def to_h(byte_ranges: false, unnamed: false, symbols: false)
+      __to_h__(byte_ranges, unnamed, symbols)
+    end
+
+    # Serializes the node in the shape of #to_h (byte ranges as [first, last] byte)
+    # straight into a string, or into io (anything responding to write) if given.
+    # Positional arguments (e.g. a JSON generator state) are ignored.
+    def to_json(*, io: nil, byte_ranges: false, unnamed: false)
+      __to_json__(io, byte_ranges, unnamed)
+    end
+
+    # Like #to_json, but writes MessagePack.
+    def to_msgpack(*, io: nil, byte_ranges: false, unnamed: false)
+      __to_msgpack__(io, byte_ranges, unnamed)
     end
 
     def inspect
@@ -26,6 +40,31 @@ module TreeSitter
       __pq_profile__(p, q, include_root_ancestors, raw, max_depth)
     end
 
+    def structural_hash(include_text: true, types: nil, bits: 64)
+      __structural_hash__(include_text, types, bits)
+    end
+
+    # Flattens this node and its descendants (preorder) into a hash of packed, frozen
+    # binary strings, one per column: symbols, fields (uint16), parents (int32, -1 for
+    # this node), start_bytes, end_bytes, start_rows, start_columns, end_rows,
+    # end_columns (uint32) and flags (uint8, see TABLE_FLAG_*), plus the row count in :size.
+    def descendants_table(named_only: false)
+      __descendants_table__(named_only)
+    end
+
+    # Walks the descendants of this node (excluding itself) in preorder,
+    # yielding those matching all given filters. types may be a symbol or an array of symbols.
+    # max_depth: 1 only visits children.
+    def each_descendant(types: nil, field: nil, named_only: false, max_depth: nil, &block)
+      return enum_for(__method__, types: types, field: field, named_only: named_only, max_depth: max_depth) unless block
+
+      __each_descendant__(types, field, named_only, max_depth, false, &block)
+    end
+
+    def find_all(type: nil, field: nil, named_only: false, max_depth: nil)
+      __each_descendant__(type, field, named_only, max_depth, true)
+    end
+
     def tokenize(ignore_whitespace: true, ignore_comments: false)
       __tokenize__(ignore_whitespace, ignore_comments)
     end
@@ -1,3 +1,4 @@
+require 'etc'
 require 'tree_sitter/core'
 
 module TreeSitter
@@ -79,14 +80,43 @@ module TreeSitter
       __path_to__ goal_byte
     end
 
-    def to_h
-      root_node.to_h
+    def to_h(**kw_args)
+      root_node.to_h(**kw_args)
+    end
+
+    def to_json(*, **kw_args)
+      root_node.to_json(**kw_args)
+    end
+
+    def to_msgpack(*, **kw_args)
+      root_node.to_msgpack(**kw_args)
+    end
+
+    def node_table(named_only: false)
+      root_node.descendants_table(named_only: named_only)
+    end
+
+    def structural_hashes(include_text: true, types: nil, bits: 64)
+      __structural_hashes__(include_text, types, bits)
     end
 
     def cursor
       root_node.cursor
     end
 
+    # Writes the tree and its attached source in a compact binary format to
+    # path_or_io (a path or anything responding to write). Read it back with
+    # e.g. TreeSitter::Python.load(path), which maps the file instead of reparsing.
+    def dump(path_or_io)
+      data = __dump__
+      if path_or_io.respond_to?(:write)
+        path_or_io.write(data)
+      else
+        File.binwrite(path_or_io, data)
+      end
+      nil
+    end
+
     class Path
       def rindex_by_field(field, before: nil)
         __rindex_by_field__ field, before
@@ -101,9 +131,180 @@ module TreeSitter
       end
     end
 
+    # A read-only tree mapped from a file written by Tree#dump.
+    class Snapshot
+      def to_h(**kw_args)
+        root_node.to_h(**kw_args)
+      end
+
+      def inspect
+        "#<#{self.class} #{language.inspect} (#{node_count} nodes)>"
+      end
+
+      # Answers the read-only subset of the Node API from the mapped file.
+      class Node
+        def type?(*types)
+          types.include?(type)
+        end
+
+        def text?(*texts)
+          texts.include?(text)
+        end
+
+        def to_h(byte_ranges: false, unnamed: false, symbols: false)
+          children = unnamed ? self.children : named_children
+          type = symbols ? self.type : self.type.name
+          hash = { type: type }
+          if children.empty? && tree.attached?
+            hash[:text] = text
+          elsif byte_ranges
+            hash[:byte_range] = byte_range
+          end
+          hash[:field] = symbols ? field : field.name if field
+          unless children.empty?
+            hash[:children] = children.map do |child|
+              child.to_h(byte_ranges: byte_ranges, unnamed: unnamed, symbols: symbols)
+            end
+          end
+          hash
+        end
+
+        def inspect
+          text = tree.attached? ? %(#{self.text.inspect} ) : nil
+          "#<#{self.class}: #{text}#{type} (#{byte_range.inspect})>"
+        end
+      end
+    end
+
     class Query
-      def run(node, start_byte: nil, end_byte: nil, start_point: nil, end_point: nil, &block)
-        __run__(node, start_byte, end_byte, start_point, end_point, &block)
+      class << self
+        def new(source, cache: true)
+          __new__(source, cache)
+        end
+
+        # Compiles named query sources into a single QuerySet.
+        def set(sources = {}, cache: true, **named_sources)
+          QuerySet.new(self, sources.merge(named_sources), cache: cache)
+        end
+      end
+
+      # A cursor: keeps the byte and point ranges set on it (Cursor#set_byte_range) unless
+      # start_byte:/end_byte: or start_point:/end_point: are given, which replace them.
+      # match_limit bounds the number of in-progress matches (and thus memory),
+      # max_start_depth how deep below node matches may start. Both apply to this
+      # call only; a cursor: keeps its own limits for later runs.
+      # Returns whether matches were dropped because match_limit was exceeded, like
+      # #each_match, #each_capture and #run_parallel. Queries are shared, so the flag
+      # is only kept per run (and on the cursor: given, see Cursor#exceeded_match_limit?).
+      # With profile: true, returns a hash of per-pattern stats (states started, matches,
+      # matches rejected by predicates and nanoseconds spent producing them) keyed by pattern index.
+      # Each match counts once however many captures it has; the search after the last match is
+      # charged to that match's pattern.
+      def run(node, start_byte: nil, end_byte: nil, start_point: nil, end_point: nil, cursor: nil,
+              match_limit: nil, max_start_depth: nil, profile: false, &block)
+        __run__(node, start_byte, end_byte, start_point, end_point, cursor, match_limit, max_start_depth, profile, &block)
+      end
+
+      # Yields captures, capture names and the pattern index once per match.
+      # Returns whether the match limit was exceeded, see #run.
+      # With packed: true, returns a binary string of 32-bit
+      # (match id, pattern index, capture id, start byte, end byte) tuples instead.
+      def each_match(node, start_byte: nil, end_byte: nil, start_point: nil, end_point: nil, cursor: nil,
+                     match_limit: nil, max_start_depth: nil, packed: false, &block)
+        unless block || packed
+          return enum_for(__method__, node, start_byte: start_byte, end_byte: end_byte,
+                                            start_point: start_point, end_point: end_point, cursor: cursor,
+                                            match_limit: match_limit, max_start_depth: max_start_depth)
+        end
+
+        __each_match__(node, start_byte, end_byte, start_point, end_point, cursor, match_limit, max_start_depth, packed, &block)
+      end
+
+      # Yields each captured node, its capture name and the pattern index once, in document order.
+      # Supports packed: like #each_match. Captures of patterns with predicates are
+      # yielded once their match is complete and has passed them.
+      def each_capture(node, start_byte: nil, end_byte: nil, start_point: nil, end_point: nil, cursor: nil,
+                     match_limit: nil, max_start_depth: nil, packed: false, &block)
+        unless block || packed
+          return enum_for(__method__, node, start_byte: start_byte, end_byte: end_byte,
+                                            start_point: start_point, end_point: end_point, cursor: cursor,
+                                            match_limit: match_limit, max_start_depth: max_start_depth)
+        end
+
+        __each_capture__(node, start_byte, end_byte, start_point, end_point, cursor, match_limit, max_start_depth, packed, &block)
+      end
+
+      # Like #each_match, but splits node's children into up to threads
+      # byte ranges which are matched concurrently on native threads.
+      # Matches are collected first and yielded in document order afterwards.
+      # Returns whether matches were dropped because match_limit was exceeded.
+      def run_parallel(node, threads: Etc.nprocessors, match_limit: nil, &block)
+        return enum_for(__method__, node, threads: threads, match_limit: match_limit) unless block
+
+        __run_parallel__(node, threads, match_limit, &block)
+      end
+    end
+
+    # Several named queries compiled into one combined query, so that a single
+    # cursor pass over the tree serves all of them.
+    # Matches are dispatched by pattern index, which is translated back to the
+    # originating query and its local pattern index.
+    class QuerySet
+      attr_reader :query, :names
+
+      def initialize(query_class, sources, cache: true)
+        @names = sources.keys.freeze
+        source_offsets = []
+        combined_source = +''
+        sources.each_value do |source|
+          source_offsets << combined_source.bytesize
+          combined_source << source << "\n"
+        end
+
+        @query = query_class.new(combined_source, cache: cache)
+
+        source_index = 0
+        @pattern_names = Array.new(@query.pattern_count) do |pattern_index|
+          start_byte = @query.pattern_start_byte(pattern_index)
+          source_index += 1 while source_index + 1 < source_offsets.size && source_offsets[source_index + 1] <= start_byte
+          @names[source_index]
+        end.freeze
+
+        @pattern_ranges = @names.to_h do |name|
+          first = @pattern_names.index(name)
+          [name, first ? first...(@pattern_names.rindex(name) + 1) : 0...0]
+        end.freeze
+        @pattern_offsets = @pattern_names.map { |name| @pattern_ranges[name].begin }.freeze
+      end
+
+      # The range of global pattern indices belonging to the named query.
+      def pattern_range(name)
+        @pattern_ranges.fetch(name)
+      end
+
+      # Maps a global pattern index to [name, local pattern index].
+      def resolve_pattern(pattern_index)
+        [@pattern_names.fetch(pattern_index), pattern_index - @pattern_offsets[pattern_index]]
+      end
+
+      # Yields the query name, captures, capture names and local pattern index once per match.
+      # Accepts the same options as Query#each_match, except packed:.
+      def each_match(node, **kw_args)
+        return enum_for(__method__, node, **kw_args) unless block_given?
+
+        @query.each_match(node, **kw_args) do |captures, capture_names, pattern_index|
+          yield @pattern_names[pattern_index], captures, capture_names, pattern_index - @pattern_offsets[pattern_index]
+        end
+      end
+
+      # Runs all queries in one pass, calling handlers[name] with
+      # captures, capture names and local pattern index for each match.
+      # Matches of queries without a handler are skipped.
+      def dispatch(node, handlers, **kw_args)
+        each_match(node, **kw_args) do |name, captures, capture_names, pattern_index|
+          handlers[name]&.call(captures, capture_names, pattern_index)
+        end
+        self
       end
     end
 
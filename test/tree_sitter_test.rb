@@ -1,9 +1,540 @@
 # frozen_string_literal: true
 
 require "test_helper"
+require "json"
+require "stringio"
+require "tempfile"
+require "objspace"
 
 class TreeSitterTest < Minitest::Test
+  SOURCE = <<~PYTHON
+    def f(x):
+      return x + 1
+
+    def g(x):
+      return x + 1
+  PYTHON
+
   def test_that_it_has_a_version_number
     refute_nil ::TreeSitter::VERSION
   end
+
+  def test_structural_hash
+    tree = TreeSitter::Python.parse(SOURCE)
+    f, g = tree.root_node.named_children
+
+    refute_equal f.structural_hash, g.structural_hash
+    assert_equal f.dig(:body).structural_hash, g.dig(:body).structural_hash
+
+    hashes = tree.structural_hashes.unpack('Q*')
+    assert_equal tree.root_node.structural_hash, hashes.first
+    assert_equal 2, hashes.count(f.dig(:body).structural_hash)
+  end
+
+  def test_structural_hash_types
+    tree = TreeSitter::Python.parse(<<~PYTHON)
+      def f(x):
+        return x + 1
+
+      def g(y):
+        return y + 1
+
+      def h(x):
+        return x + 2
+    PYTHON
+    f, g, h = tree.root_node.named_children
+
+    # filtered out types are skipped with their subtrees, so the names
+    # and parameters don't count, but the integers below them do
+    types = %i[function_definition block return_statement binary_operator integer]
+    assert_equal f.structural_hash(types: types), g.structural_hash(types: types)
+    refute_equal f.structural_hash(types: types), h.structural_hash(types: types)
+    refute_equal f.structural_hash(types: types + [:identifier]), g.structural_hash(types: types + [:identifier])
+
+    assert_raises(TypeError) { f.structural_hash(types: [:block, 'integer']) }
+    assert_raises(ArgumentError) { f.structural_hash(types: %i[block no_such_type]) }
+  end
+
+  def test_query_cache
+    language = TreeSitter::Python.language
+    language.clear_query_cache
+
+    TreeSitter::Python::Query.new('(identifier) @id')
+    TreeSitter::Python::Query.new('(identifier) @id')
+    TreeSitter::Python::Query.new('(identifier) @id', cache: false)
+    assert_equal 1, language.query_cache_size
+  end
+
+  def test_query_cursor
+    tree = TreeSitter::Python.parse(SOURCE)
+    query = TreeSitter::Python::Query.new('(identifier) @id')
+    cursor = TreeSitter::Tree::Query::Cursor.new
+
+    cursor.set_byte_range(0, 6)
+    texts = []
+    cursor.exec(query, tree.root_node) { |captures, _| texts << captures.first.text }
+    assert_equal %w[f], texts
+
+    texts = []
+    query.run(tree.root_node, cursor: cursor) { |captures, _| texts << captures.first.text }
+    assert_equal %w[f], texts
+
+    texts = []
+    query.run(tree.root_node, cursor: cursor, start_byte: 0) { |captures, _| texts << captures.first.text }
+    assert_equal %w[f x x g x x], texts
+    assert_equal "TreeSitter::Tree::Query::Cursor", JSON.parse(ObjectSpace.dump(cursor))["struct"]
+  end
+
+  def test_query_predicates
+    tree = TreeSitter::Python.parse(SOURCE)
+    {
+      '((identifier) @id (#eq? @id "x"))' => %w[x x x x],
+      '((identifier) @id (#not-eq? @id "x"))' => %w[f g],
+      '((identifier) @id (#match? @id "^[fg]$"))' => %w[f g],
+      '((identifier) @id (#any-of? @id "g" "h"))' => %w[g]
+    }.each do |source, expected|
+      texts = []
+      TreeSitter::Python::Query.new(source).run(tree.root_node) { |captures, _| texts << captures.first.text }
+      assert_equal expected, texts, source
+    end
+
+    assert_raises(ArgumentError) { TreeSitter::Python::Query.new('((identifier) @id (#match? @id "("))') }
+
+    # an absent capture is not equal to anything, and captures are only
+    # returned once their match is complete, with all operands known
+    tree = TreeSitter::Python.parse("def f(): pass\ndef g(g): pass\ndef h(x): pass\n")
+    {
+      'eq?' => [%w[g g]],
+      'not-eq?' => [%w[f], %w[h x]]
+    }.each do |name, expected|
+      query = TreeSitter::Python::Query.new(
+        "(function_definition name: (identifier) @name parameters: (parameters (identifier)? @param) (##{name} @name @param))"
+      )
+      assert_equal expected, query.each_match(tree.root_node).map { |nodes, _, _| nodes.map(&:text) }, name
+      assert_equal expected.flatten, query.each_capture(tree.root_node).map { |node, _, _| node.text }, name
+    end
+
+    # the first capture returned is outside the range, the match is still checked
+    tree = TreeSitter::Python.parse("a + a\nb + c\n")
+    query = TreeSitter::Python::Query.new('((binary_operator left: (_) @left right: (_) @right) (#not-eq? @left "a"))')
+    assert_equal %w[b c], query.each_capture(tree.root_node, start_byte: 4).map { |node, _, _| node.text }
+  end
+
+  def test_query_each_match_and_capture
+    tree = TreeSitter::Python.parse(SOURCE)
+    query = TreeSitter::Python::Query.new('(binary_operator left: (_) @left right: (_) @right)')
+    assert_equal %i[left right], query.capture_names
+
+    matches = query.each_match(tree.root_node).map { |nodes, names, _| [nodes.map(&:text), names] }
+    assert_equal [[%w[x 1], %i[left right]]] * 2, matches
+
+    captures = query.each_capture(tree.root_node).map { |node, name, _| [node.text, name] }
+    assert_equal [['x', :left], ['1', :right]] * 2, captures
+
+    tuples = query.each_capture(tree.root_node, packed: true).unpack('L*').each_slice(5).to_a
+    assert_equal captures.size, tuples.size
+    assert_equal SOURCE.index('x + 1'), tuples.first[3]
+  end
+
+  def test_query_set
+    tree = TreeSitter::Python.parse(SOURCE)
+    set = TreeSitter::Python::Query.set(
+      functions: '(function_definition name: (identifier) @name)',
+      operators: '(binary_operator left: (_) @left) (binary_operator right: (_) @right)'
+    )
+    assert_equal 3, set.query.pattern_count
+    assert_equal 1...3, set.pattern_range(:operators)
+    assert_equal [:operators, 1], set.resolve_pattern(2)
+
+    functions = []
+    operators = []
+    handlers = {
+      functions: ->(captures, _, _) { functions << captures.first.text },
+      operators: ->(captures, names, pattern_index) { operators << [captures.first.text, names.first, pattern_index] }
+    }
+    set.dispatch(tree.root_node, handlers)
+    assert_equal %w[f g], functions
+    assert_equal [['x', :left, 0], ['1', :right, 1]] * 2, operators
+  end
+
+  def test_query_run_parallel
+    tree = TreeSitter::Python.parse(SOURCE * 4)
+    ['(identifier) @id', '(module) @module', '((identifier) @id (#eq? @id "g"))'].each do |source|
+      query = TreeSitter::Python::Query.new(source)
+      expected = query.each_match(tree.root_node).map { |nodes, _, _| nodes.map(&:start_byte) }
+      [1, 3, 16].each do |threads|
+        actual = query.run_parallel(tree.root_node, threads: threads).map { |nodes, _, _| nodes.map(&:start_byte) }
+        assert_equal expected, actual, "#{source} with #{threads} threads"
+      end
+    end
+  end
+
+  def test_query_match_limit
+    tree = TreeSitter::Python.parse("x = [#{(1..50).to_a.join(', ')}]\n")
+    query = TreeSitter::Python::Query.new('(list (integer) @a (integer) @b)')
+
+    cursor = TreeSitter::Tree::Query::Cursor.new
+    query.each_match(tree.root_node, cursor: cursor) {}
+    refute cursor.exceeded_match_limit?
+
+    limited = TreeSitter::Tree::Query::Cursor.new
+    count = 0
+    query.each_match(tree.root_node, cursor: limited, match_limit: 4) do
+      # a nested run on the same (shared) query doesn't affect the outer one
+      query.each_match(tree.root_node, cursor: cursor) {} if count.zero?
+      count += 1
+    end
+    assert_operator count, :<, 50 * 49 / 2
+    assert limited.exceeded_match_limit?
+    refute cursor.exceeded_match_limit?
+
+    assert query.run_parallel(tree.root_node, threads: 2, match_limit: 4) {}
+    refute query.run_parallel(tree.root_node, threads: 2) {}
+    assert query.each_match(tree.root_node, match_limit: 4) {}
+    assert query.each_capture(tree.root_node, match_limit: 4) {}
+    assert query.run(tree.root_node, match_limit: 4) {}
+    refute query.run(tree.root_node) {}
+
+    # a cursor whose capture lists grew in an unlimited run still honors a limit
+    reused = TreeSitter::Tree::Query::Cursor.new
+    assert_equal 50 * 49 / 2, query.each_match(tree.root_node, cursor: reused).count
+    assert_operator query.each_match(tree.root_node, cursor: reused, match_limit: 4).count, :<, 50 * 49 / 2
+    assert reused.exceeded_match_limit?
+
+    # per-call limits don't stick to the cursor, its own ones do
+    assert_equal 2**32 - 1, reused.match_limit
+    assert_equal 50 * 49 / 2, query.each_match(tree.root_node, cursor: reused).count
+    refute reused.exceeded_match_limit?
+    reused.match_limit = 4
+    refute query.each_match(tree.root_node, cursor: reused, match_limit: 10_000) {}
+    assert_operator query.each_match(tree.root_node, cursor: reused).count, :<, 50 * 49 / 2
+    assert_equal 4, reused.match_limit
+
+    identifiers = TreeSitter::Python::Query.new('(identifier) @id')
+    assert_equal 0, identifiers.each_match(tree.root_node, max_start_depth: 0).count
+  end
+
+  def test_query_profile
+    tree = TreeSitter::Python.parse(SOURCE)
+    query = TreeSitter::Python::Query.new('((identifier) @id (#eq? @id "x")) (integer) @int')
+    stats = query.run(tree.root_node, profile: true) {}
+
+    assert_equal [0, 1], stats.keys
+    assert_equal 4, stats[0][:matches]
+    assert_equal 2, stats[0][:rejected]
+    assert_equal 6, stats[0][:states]
+    assert_equal 2, stats[1][:matches]
+    assert_operator stats[1][:ns], :>, 0
+
+    # one match per match, not per capture
+    tree = TreeSitter::Python.parse("a + 1\nb + 2\nc + 3\n")
+    query = TreeSitter::Python::Query.new(<<~QUERY)
+      (binary_operator left: (identifier) @left right: (integer) @right)
+      ((binary_operator left: (identifier) @left right: (integer) @right) (#not-eq? @left "b"))
+    QUERY
+    stats = query.run(tree.root_node, profile: true) {}
+    assert_equal 3, stats[0][:matches]
+    assert_equal 0, stats[0][:rejected]
+    assert_equal 2, stats[1][:matches]
+    assert_equal 1, stats[1][:rejected]
+  end
+
+  def test_node_table
+    tree = TreeSitter::Python.parse(SOURCE)
+    table = tree.node_table(named_only: true)
+    nodes = []
+    walk = ->(node) { nodes << node if node.named?; node.each_child { walk.(_1) } }
+    walk.(tree.root_node)
+
+    assert_equal nodes.size, table[:size]
+    assert_equal nodes.map(&:start_byte), table[:start_bytes].unpack('L*')
+    assert_equal nodes.map(&:end_byte), table[:end_bytes].unpack('L*')
+    assert_equal nodes.map { _1.start_point.row }, table[:start_rows].unpack('L*')
+    assert_equal nodes.map(&:type), table[:symbols].unpack('S*').map { tree.language.symbols[_1] }
+
+    parents = table[:parents].unpack('l*')
+    assert_equal(-1, parents.first)
+    assert_equal nodes.drop(1).map { nodes.index(_1.parent) }, parents.drop(1)
+    assert table[:flags].unpack('C*').all? { _1 & TreeSitter::Node::TABLE_FLAG_NAMED != 0 }
+  end
+
+  def test_node_positions
+    tree = TreeSitter::Python.parse(SOURCE)
+    node = tree.root_node.named_child_at(1)
+    positions = node.positions
+
+    assert positions.frozen?
+    assert_equal [node.start_byte, node.end_byte,
+                  node.start_point.row, node.start_point.column,
+                  node.end_point.row, node.end_point.column], positions
+    assert_equal positions[2..], [node.start_row, node.start_column, node.end_row, node.end_column]
+  end
+
+  def test_each_descendant
+    tree = TreeSitter::Python.parse(SOURCE)
+    root = tree.root_node
+
+    assert_equal %w[f x x g x x], root.find_all(type: :identifier).map(&:text)
+    assert_equal %w[f g], root.find_all(type: :identifier, field: :name).map(&:text)
+    assert_equal %w[x 1 x 1], root.find_all(type: :binary_operator).flat_map { _1.find_all(max_depth: 1, named_only: true).map(&:text) }
+    assert_equal 2, root.each_descendant(max_depth: 1).count
+    assert root.each_descendant(named_only: true).all?(&:named?)
+    assert_equal :name, root.find_all(field: :name).first.field
+    assert_raises(ArgumentError) { root.find_all(type: :no_such_type) }
+    assert_raises(TypeError) { root.each_descendant(types: [:identifier, "integer"]) {} }
+  end
+
+  def test_ancestor_cache
+    tree = TreeSitter::Python.parse(SOURCE)
+    name = tree.root_node.find_all(type: :identifier, field: :name).last
+    x = tree.root_node.named_child_at(1).find_all(type: :identifier, field: :left).first
+
+    assert_equal 'g', name.text
+    assert_equal %i[function_definition module], name.parents.map(&:type)
+    assert_equal tree.root_node.named_child_at(1), name.parent
+    assert_nil tree.root_node.parent
+
+    fresh = x.parent.child_at(0)
+    assert_equal :left, fresh.field
+    assert fresh.field?(:left, :right)
+    refute fresh.field?(:right)
+    assert_equal :operator, x.parent.child_at(1).field
+
+    assert name.has_ancestor_path?(:function_definition, :name)
+    assert fresh.has_ancestor_path?(:return_statement, :binary_operator, :left)
+    refute fresh.has_ancestor_path?(:function_definition, :binary_operator, :left)
+    refute name.has_ancestor_path?(:function_definition, :body)
+  end
+
+  def test_paths_to
+    source = SOURCE * 40
+    tree = TreeSitter::Python.parse(source)
+    offsets = (0...source.bytesize).to_a.shuffle(random: Random.new(1))
+    expected = offsets.map { tree.path_to(_1).to_s }
+
+    assert_equal expected, tree.paths_to(offsets).map(&:to_s)
+    assert_raises(TypeError) { tree.paths_to([0, nil]) }
+    assert_raises(RangeError) { tree.paths_to([0, 2**40]) }
+
+    path = tree.path_to(source.index('x + 1'))
+    assert_same path.last, path[-1]
+    assert_equal :left, path.last.field
+    assert_equal %i[module function_definition block return_statement binary_operator identifier], path.map(&:type)
+  end
+
+  def test_nodes_at
+    source = SOURCE * 40
+    tree = TreeSitter::Python.parse(source)
+    offsets = (0..source.bytesize).to_a.shuffle(random: Random.new(1))
+    expected = offsets.map { tree.path_to(_1).last }
+
+    assert_equal expected, tree.nodes_at(offsets)
+    assert_equal expected.first(10), offsets.first(10).map { tree.find_by_byte(_1) }
+    assert_raises(TypeError) { tree.nodes_at([0, '1']) }
+
+    # byte ranges descend like Tree#path_to
+    tree.root_node.each_descendant do |node|
+      range = node.byte_range
+      next if range.none?
+
+      assert_equal tree.path_to(node).last, tree.find_by_byte([range.min, range.max])
+    end
+  end
+
+  def test_to_json
+    tree = TreeSitter::Python.parse(%(def f(x):\n  return "a\\n/" + x\n))
+    range_to_a = lambda do |hash|
+      hash.to_h { |k, v| [k.to_s, v.is_a?(Range) ? v.minmax : v.is_a?(Array) ? v.map(&range_to_a) : v] }
+    end
+
+    %i[byte_ranges unnamed].each do |option|
+      expected = range_to_a.(tree.root_node.to_h(option => true))
+      assert_equal expected, JSON.parse(tree.root_node.to_json(option => true))
+    end
+
+    io = StringIO.new
+    tree.root_node.to_json(io: io)
+    assert_equal tree.to_json, io.string
+    assert_equal tree.to_json, JSON.generate([tree.root_node])[1...-1]
+  end
+
+  # just the parts of MessagePack that #to_msgpack writes
+  def msgpack_decode(bytes)
+    io = StringIO.new(bytes.b)
+    read = lambda do
+      tag = io.readbyte
+      str = ->(len) { io.read(len).force_encoding(Encoding::UTF_8) }
+      map = ->(len) { Array.new(len) { [read.(), read.()] }.to_h }
+      array = ->(len) { Array.new(len) { read.() } }
+      case tag
+      when 0x00..0x7f then tag
+      when 0x80..0x8f then map.(tag & 0x0f)
+      when 0x90..0x9f then array.(tag & 0x0f)
+      when 0xa0..0xbf then str.(tag & 0x1f)
+      when 0xc0 then nil
+      when 0xcc then io.readbyte
+      when 0xcd then io.read(2).unpack1('n')
+      when 0xce then io.read(4).unpack1('N')
+      when 0xd9 then str.(io.readbyte)
+      when 0xda then str.(io.read(2).unpack1('n'))
+      when 0xdb then str.(io.read(4).unpack1('N'))
+      when 0xdc then array.(io.read(2).unpack1('n'))
+      when 0xdd then array.(io.read(4).unpack1('N'))
+      when 0xde then map.(io.read(2).unpack1('n'))
+      when 0xdf then map.(io.read(4).unpack1('N'))
+      when 0xe0..0xff then tag - 0x100
+      else flunk format('unexpected msgpack tag 0x%02x', tag)
+      end
+    end
+    value = read.()
+    assert io.eof?, 'trailing bytes after the msgpack value'
+    value
+  end
+
+  def test_to_msgpack
+    tree = TreeSitter::Python.parse("1")
+    assert_equal "\x82\xA4type\xA6module\xA8children\x91" \
+                 "\x82\xA4type\xB4expression_statement\xA8children\x91" \
+                 "\x82\xA4type\xA7integer\xA4text\xA11".b,
+                 tree.to_msgpack
+
+    # long strings, more than 15 children and byte offsets past 16 bits
+    # exercise the wider encodings
+    source = +"x = [#{(1..20).to_a.join(', ')}]\n"
+    source << "t = (1, 2)\n" * 10
+    source << %(s = "#{'a' * 40}" + "#{'b' * 300}"\n)
+    source << "# #{'c' * 70_000}\ny = 1\n"
+    tree = TreeSitter::Python.parse(source)
+    [{}, { byte_ranges: true }, { unnamed: true }, { byte_ranges: true, unnamed: true }].each do |options|
+      msgpack = tree.root_node.to_msgpack(**options)
+      assert_equal JSON.parse(tree.root_node.to_json(**options)), msgpack_decode(msgpack), options.inspect
+
+      io = StringIO.new
+      tree.root_node.to_msgpack(io: io, **options)
+      assert_equal msgpack, io.string.b
+    end
+  end
+
+  def test_to_h_interned_types
+    tree = TreeSitter::Python.parse(SOURCE)
+    h = tree.to_h
+    first, second = h[:children]
+    assert_equal "module", h[:type]
+    assert first[:type].frozen?
+    assert_same first[:type], second[:type]
+    assert_same first[:children][0][:field], second[:children][0][:field]
+
+    sym = tree.to_h(symbols: true)
+    assert_equal :function_definition, sym[:children][0][:type]
+    assert_equal :name, sym[:children][0][:children][0][:field]
+  end
+
+  def test_dump_and_load
+    tree = TreeSitter::Python.parse(SOURCE)
+    Tempfile.create(["tree", ".tsdump"]) do |file|
+      tree.dump(file.path)
+      snapshot = TreeSitter::Python.load(file.path)
+
+      assert_equal tree.to_h(byte_ranges: true, unnamed: true), snapshot.to_h(byte_ranges: true, unnamed: true)
+      assert_equal SOURCE, snapshot.source
+
+      node = snapshot.root_node.named_child_at(1).child_by_field(:name)
+      assert_equal "g", node.text
+      assert_equal :identifier, node.type
+      assert_equal :name, node.field
+      assert_equal [3, 4], [node.start_row, node.start_column]
+      assert_equal tree.root_node.named_child_at(1).child_by_field(:name).positions, node.positions
+      assert_equal [:function_definition, :module], node.parents.map(&:type)
+      assert_equal snapshot.root_node, node.parent.parent
+
+      assert_raises(TreeSitter::Error) { TreeSitter::Python.load(__FILE__) }
+    end
+  end
+
+  def test_load_corrupt_dump
+    io = StringIO.new
+    TreeSitter::Python.parse(SOURCE).dump(io)
+    data = io.string.b
+    header_size = 32
+    node_size = 44
+    corrupt = lambda do |offset, value|
+      bytes = data.dup
+      bytes[offset, 4] = [value].pack('L')
+      bytes
+    end
+
+    [
+      data[0, data.bytesize - 1],
+      corrupt[header_size + node_size + 20, 0x40000000], # start_byte
+      corrupt[header_size + node_size + 12, 0],          # descendant_count
+      corrupt[header_size + 12, 1_000_000],              # descendant_count past the end
+      corrupt[header_size + 16, 1_000_000],              # child_count
+      corrupt[header_size + node_size + 8, 5]            # parent after the node
+    ].each do |bytes|
+      Tempfile.create(["corrupt", ".tsdump"]) do |file|
+        file.binmode
+        file.write(bytes)
+        file.close
+        assert_raises(TreeSitter::Error) { TreeSitter::Python.load(file.path) }
+      end
+    end
+  end
+
+  def test_memsize
+    small = TreeSitter::Python.parse(SOURCE)
+    large = TreeSitter::Python.parse(SOURCE * 100)
+    assert_operator ObjectSpace.memsize_of(large), :>, 50 * ObjectSpace.memsize_of(small) / 2
+    assert_operator ObjectSpace.memsize_of(small), :>, 0
+    assert_operator ObjectSpace.memsize_of(TreeSitter::Python.language), :>, 0
+    # copies share the original's subtrees
+    assert_operator ObjectSpace.memsize_of(large.copy), :<, ObjectSpace.memsize_of(small)
+    assert_operator ObjectSpace.memsize_of(TreeSitter::Python::Query.new('(identifier) @id', cache: false)), :>, 0
+
+    GC.disable
+    stats = TreeSitter.memory_stats
+    assert_operator stats[:trees], :>=, 2
+    assert_operator stats[:tree_bytes], :>=, ObjectSpace.memsize_of(large)
+    TreeSitter::Python.parse(SOURCE)
+    assert_equal stats[:trees] + 1, TreeSitter.memory_stats[:trees]
+  ensure
+    GC.enable
+  end
+
+  def test_tracked_allocator
+    language = TreeSitter::Python.language
+    GC.disable
+    before = language.live_bytes
+    tree = TreeSitter::Python.parse(SOURCE * 50)
+    assert_operator language.live_bytes - before, :>=, ObjectSpace.memsize_of(tree) - ObjectSpace.memsize_of(TreeSitter::Python.parse(""))
+
+    stats = TreeSitter.memory_stats
+    assert_operator stats[:live_bytes], :>=, stats[:tree_bytes] + stats[:query_bytes]
+    assert_operator stats[:live_allocations], :>, 0
+  ensure
+    GC.enable
+  end
+
+  def test_arena_tree
+    tree = TreeSitter::Python.parse(SOURCE * 20, arena: true)
+    assert_equal TreeSitter::Python.parse(SOURCE * 20).to_h(byte_ranges: true), tree.to_h(byte_ranges: true)
+
+    copy = tree.copy
+    tree = nil
+    GC.start
+    assert_instance_of TreeSitter::Python, copy
+    assert_equal 40, copy.root_node.find_all(type: :function_definition).size
+  end
+
+  def test_language_names
+    language = TreeSitter::Python.language
+    assert_includes language.fields, :name
+    refute_includes language.fields, nil
+    assert_includes language.symbols, :function_definition
+
+    function = TreeSitter::Python.parse(SOURCE).root_node.find_all(type: :function_definition).first
+    assert_equal :identifier, function.child_by_field(:name).type
+    assert_nil function.child_by_field(:no_such_field)
+    assert function.child_by_field(:name).descendant_of_type?(:function_definition)
+    assert_raises(TreeSitter::Error) { function.child_by_field(:name).descendant_of_type?(:no_such_type) }
+  end
 end